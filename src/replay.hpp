@@ -13,90 +13,3303 @@ License: MIT
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
 #include <nlohmann/json.hpp>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-class Replay {
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__GNUC__) || defined(__clang__))
+#define REPLAY_CRC32C_X86 1
+#include <nmmintrin.h>
+#else
+#define REPLAY_CRC32C_X86 0
+#endif
+
+// Page backing of in-memory data: regular pages, transparent huge pages
+// (MADV_HUGEPAGE on the file mapping), or explicit huge pages (the file is
+// copied into a MAP_HUGETLB mapping; if no huge pages are reserved, into an
+// anonymous mapping with MADV_HUGEPAGE). Huge pages are a request, not a
+// guarantee: huge_page_bytes() reports what the kernel actually provided.
+enum class ReplayHugePages { none, transparent, hugetlb };
+
+// Read-only view of a whole file. On POSIX systems the file is memory mapped,
+// elsewhere it is read into memory once.
+class ReplayMappedFile {
+public:
+  explicit ReplayMappedFile(const std::string &path,
+                            ReplayHugePages pages = ReplayHugePages::none) {
+#if !defined(_WIN32)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open CSV file: " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Failed to stat CSV file: " + path);
+    }
+    _size = static_cast<size_t>(st.st_size);
+    if (_size > 0) {
+      bool loaded = pages == ReplayHugePages::hugetlb && load_anonymous(fd);
+      if (!loaded) {
+        void *addr = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+          ::close(fd);
+          throw std::runtime_error("Failed to map CSV file: " + path);
+        }
+        _data = static_cast<const char *>(addr);
+        _map_size = _size;
+        if (pages == ReplayHugePages::transparent) {
+          advise_huge(_data, _size);
+        }
+      }
+      _mapped = true;
+    }
+    ::close(fd);
+#else
+    (void)pages;
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      throw std::runtime_error("Failed to open CSV file: " + path);
+    }
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    _buffer = ss.str();
+    _data = _buffer.data();
+    _size = _buffer.size();
+#endif
+  }
+
+  ~ReplayMappedFile() {
+#if !defined(_WIN32)
+    if (_mapped) {
+      ::munmap(const_cast<char *>(_data), _map_size);
+    }
+#endif
+  }
+
+  ReplayMappedFile(const ReplayMappedFile &) = delete;
+  ReplayMappedFile &operator=(const ReplayMappedFile &) = delete;
+
+  const char *data() const { return _data; }
+  size_t size() const { return _size; }
+
+  // True if the data lives in explicit (MAP_HUGETLB) huge pages
+  bool hugetlb() const { return _hugetlb; }
+
+  // Bytes of the data currently backed by huge pages
+  size_t huge_page_bytes() const {
+    return _hugetlb ? _map_size : huge_page_bytes(_data, _size);
+  }
+
+  // Hint the kernel to start reading a range ahead of its use
+  void prefetch(size_t offset, size_t length) const {
+#if !defined(_WIN32)
+    if (!_mapped || offset >= _size) {
+      return;
+    }
+    const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t begin = offset - offset % page;
+    size_t end = std::min(_size, offset + length);
+    ::madvise(const_cast<char *>(_data) + begin, end - begin, MADV_WILLNEED);
+#else
+    (void)offset;
+    (void)length;
+#endif
+  }
+
+  // Ask for transparent huge pages on the page-aligned part of a range
+  static void advise_huge(const void *addr, size_t length) {
+#if defined(MADV_HUGEPAGE)
+    const uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+    uintptr_t end = (begin + length) & ~(page - 1);
+    begin = (begin + page - 1) & ~(page - 1);
+    if (end > begin) {
+      ::madvise(reinterpret_cast<void *>(begin), end - begin, MADV_HUGEPAGE);
+    }
+#else
+    (void)addr;
+    (void)length;
+#endif
+  }
+
+  // Bytes of a range backed by huge pages, from /proc/self/smaps (0 where
+  // that is not available)
+  static size_t huge_page_bytes(const void *addr, size_t length) {
+    size_t total = 0;
+#if defined(__linux__)
+    std::ifstream smaps("/proc/self/smaps");
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+    const uintptr_t end = begin + length;
+    bool inside = false;
+    std::string line;
+    while (std::getline(smaps, line)) {
+      // Mapping headers ("lo-hi perms ...") start each block of fields
+      unsigned long lo = 0, hi = 0;
+      char dash = 0;
+      std::istringstream header(line);
+      if (line.find(':') > line.find(' ') &&
+          header >> std::hex >> lo >> dash >> hi && dash == '-') {
+        inside = lo < end && hi > begin;
+        continue;
+      }
+      if (!inside) {
+        continue;
+      }
+      for (const char *key :
+           {"AnonHugePages:", "FilePmdMapped:", "ShmemPmdMapped:"}) {
+        if (line.compare(0, std::strlen(key), key) == 0) {
+          total += std::stoul(line.substr(std::strlen(key))) * 1024;
+        }
+      }
+    }
+#else
+    (void)addr;
+    (void)length;
+#endif
+    return total;
+  }
+
+private:
+  const char *_data = "";
+  size_t _size = 0;
+  size_t _map_size = 0;
+  bool _mapped = false;
+  bool _hugetlb = false;
+  std::string _buffer;
+
+#if !defined(_WIN32)
+  // Copy the file into anonymous memory, in explicit huge pages if the
+  // kernel has them reserved, otherwise in transparent ones
+  bool load_anonymous(int fd) {
+    void *addr = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+    const size_t huge = huge_page_size();
+    if (huge > 0) {
+      _map_size = (_size + huge - 1) / huge * huge;
+      addr = ::mmap(nullptr, _map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      _hugetlb = addr != MAP_FAILED;
+    }
+#endif
+    if (addr == MAP_FAILED) {
+      _map_size = _size;
+      addr = ::mmap(nullptr, _map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (addr == MAP_FAILED) {
+        return false;
+      }
+      advise_huge(addr, _map_size);
+    }
+    char *dst = static_cast<char *>(addr);
+    size_t done = 0;
+    while (done < _size) {
+      ssize_t n =
+          ::pread(fd, dst + done, _size - done, static_cast<off_t>(done));
+      if (n <= 0) {
+        ::munmap(addr, _map_size);
+        _hugetlb = false;
+        return false;
+      }
+      done += static_cast<size_t>(n);
+    }
+    ::mprotect(addr, _map_size, PROT_READ);
+    _data = dst;
+    return true;
+  }
+
+  // Default huge page size from /proc/meminfo, 0 if unknown
+  static size_t huge_page_size() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line)) {
+      if (line.compare(0, 13, "Hugepagesize:") == 0) {
+        return std::stoul(line.substr(13)) * 1024;
+      }
+    }
+    return 0;
+  }
+#endif
+};
+
+// Line and field level CSV helpers that do not depend on the dialect
+struct ReplayCsv {
+  // Extract the line starting at pos (without the trailing newline) and move
+  // pos past it
+  static std::string_view next_line(const char *data, size_t size,
+                                    size_t &pos) {
+    const char *begin = data + pos;
+    const void *nl = std::memchr(begin, '\n', size - pos);
+    size_t len = nl ? static_cast<size_t>(static_cast<const char *>(nl) - begin)
+                    : size - pos;
+    pos += nl ? len + 1 : len;
+    return std::string_view(begin, len);
+  }
+
+  // Check if a line is empty or contains only whitespace
+  static bool is_empty_line(std::string_view line) {
+    return line.find_first_not_of(" \t\r\n") == std::string_view::npos;
+  }
+
+  static bool is_numeric(const std::string &str) {
+    if (str.empty())
+      return false;
+
+    char *end;
+    std::strtod(str.c_str(), &end);
+    return end == str.c_str() + str.length();
+  }
+
+  static double parse_number(const std::string &str) {
+    return std::strtod(str.c_str(), nullptr);
+  }
+
+  static std::string normalize_keypath(const std::string &input) {
+    std::string output;
+    if (input.empty()) {
+      return "/";
+    }
+    if (input[0] == '/') { // already a json_pointer string
+      return input;
+    }
+    output.reserve(input.size() + 1);
+
+    for (size_t i = 0; i < input.size(); ++i) {
+      char c = input[i];
+
+      if (c == ']') {
+        // If ']' is followed by '.', replace the pair "]." with '/'
+        if (i + 1 < input.size() && input[i + 1] == '.') {
+          output.push_back('/');
+          ++i; // skip the dot as well
+        }
+        // otherwise skip the ']' (remove it)
+      } else if (c == '.' || c == '[') {
+        output.push_back('/');
+      } else {
+        output.push_back(c);
+      }
+    }
+    if (output.empty() || output[0] != '/') {
+      output = "/" + output;
+    }
+    return output;
+  }
+};
+
+// CSV dialect policies. A dialect provides the delimiter, quote, escape and
+// comment characters (escape '\0' means no escaping) and whether unquoted
+// leading/trailing blanks are trimmed from fields. Each policy gets its own
+// instantiation of ReplayTokenizer, so the hot loop compares against
+// constants.
+struct ReplayCommaDialect {
+  static constexpr char delimiter = ',';
+  static constexpr char quote = '"';
+  static constexpr char escape = '\0';
+  static constexpr char comment = '#';
+  static constexpr bool trim = false;
+};
+
+struct ReplayTabDialect : ReplayCommaDialect {
+  static constexpr char delimiter = '\t';
+};
+
+struct ReplaySemicolonDialect : ReplayCommaDialect {
+  static constexpr char delimiter = ';';
+};
+
+struct ReplayPipeDialect : ReplayCommaDialect {
+  static constexpr char delimiter = '|';
+};
+
+// Dialects selectable at runtime; automatic sniffs the file content
+enum class ReplayDialect { automatic, comma, tab, semicolon, pipe };
+
+template <class Dialect> struct ReplayTokenizer {
+  // Split a line into fields, reusing the storage in fields. Quotes toggle
+  // the quoted state and are removed; delimiters inside quotes are kept,
+  // and a doubled quote inside quotes stands for one quote (RFC 4180).
+  static void split_line(std::string_view line,
+                         std::vector<std::string> &fields) {
+    size_t count = 0;
+    auto next_field = [&fields, &count]() -> std::string & {
+      if (count == fields.size()) {
+        fields.emplace_back();
+      }
+      std::string &f = fields[count++];
+      f.clear();
+      return f;
+    };
+
+    std::string *field = &next_field();
+    bool in_quotes = false;
+    bool quoted = false;
+    size_t start = 0;
+    for (size_t i = 0; i < line.size(); ++i) {
+      char c = line[i];
+      if (Dialect::escape != '\0' && c == Dialect::escape &&
+          i + 1 < line.size()) {
+        field->append(line.data() + start, i - start);
+        start = ++i; // keep the escaped character verbatim
+      } else if (c == Dialect::quote) {
+        if (in_quotes && i + 1 < line.size() && line[i + 1] == Dialect::quote) {
+          field->append(line.data() + start, i + 1 - start);
+          start = ++i + 1;
+          continue;
+        }
+        field->append(line.data() + start, i - start);
+        start = i + 1;
+        in_quotes = !in_quotes;
+        quoted = true;
+      } else if (c == Dialect::delimiter && !in_quotes) {
+        field->append(line.data() + start, i - start);
+        if (Dialect::trim && !quoted) {
+          trim_field(*field);
+        }
+        start = i + 1;
+        quoted = false;
+        field = &next_field();
+      }
+    }
+    // Add the last field
+    field->append(line.data() + start, line.size() - start);
+    if (Dialect::trim && !quoted) {
+      trim_field(*field);
+    }
+    fields.resize(count);
+  }
+
+  static std::vector<std::string> parse_csv_line(std::string_view line) {
+    std::vector<std::string> result;
+    split_line(line, result);
+    return result;
+  }
+
+  // Locate the fields of a line without copying them: each span is the raw
+  // field text, still quoted/escaped, to be decoded with decode_field()
+  static void locate_fields(std::string_view line,
+                            std::vector<std::string_view> &spans) {
+    spans.clear();
+    bool in_quotes = false;
+    size_t start = 0;
+    for (size_t i = 0; i < line.size(); ++i) {
+      char c = line[i];
+      if (Dialect::escape != '\0' && c == Dialect::escape) {
+        ++i;
+      } else if (c == Dialect::quote) {
+        in_quotes = !in_quotes;
+      } else if (c == Dialect::delimiter && !in_quotes) {
+        spans.push_back(line.substr(start, i - start));
+        start = i + 1;
+      }
+    }
+    spans.push_back(line.substr(std::min(start, line.size())));
+  }
+
+  // Decode a raw field located by locate_fields(), with the same rules as
+  // split_line()
+  static void decode_field(std::string_view raw, std::string &out) {
+    out.clear();
+    bool in_quotes = false;
+    bool quoted = false;
+    size_t start = 0;
+    for (size_t i = 0; i < raw.size(); ++i) {
+      char c = raw[i];
+      if (Dialect::escape != '\0' && c == Dialect::escape &&
+          i + 1 < raw.size()) {
+        out.append(raw.data() + start, i - start);
+        start = ++i;
+      } else if (c == Dialect::quote) {
+        if (in_quotes && i + 1 < raw.size() && raw[i + 1] == Dialect::quote) {
+          out.append(raw.data() + start, i + 1 - start);
+          start = ++i + 1;
+          continue;
+        }
+        out.append(raw.data() + start, i - start);
+        start = i + 1;
+        in_quotes = !in_quotes;
+        quoted = true;
+      }
+    }
+    out.append(raw.data() + start, raw.size() - start);
+    if (Dialect::trim && !quoted) {
+      trim_field(out);
+    }
+  }
+
+  // Check if a line is a comment (starts with the comment character with
+  // optional leading spaces)
+  static bool is_comment_line(std::string_view line) {
+    size_t first_char = line.find_first_not_of(' ');
+    if (first_char == std::string_view::npos) {
+      return false; // Empty line or only spaces - not a comment
+    }
+    return line[first_char] == Dialect::comment;
+  }
+
+  static bool is_ignorable_line(std::string_view line) {
+    return is_comment_line(line) || ReplayCsv::is_empty_line(line);
+  }
+
+  static void trim_field(std::string &field) {
+    size_t last = field.find_last_not_of(" \t\r");
+    if (last == std::string::npos) {
+      field.clear();
+      return;
+    }
+    field.erase(last + 1);
+    field.erase(0, field.find_first_not_of(" \t\r"));
+  }
+};
+
+// Call func with a tokenizer instance for the given (non automatic) dialect
+template <typename Func>
+decltype(auto) replay_visit_dialect(ReplayDialect dialect, Func &&func) {
+  switch (dialect) {
+  case ReplayDialect::tab:
+    return func(ReplayTokenizer<ReplayTabDialect>{});
+  case ReplayDialect::semicolon:
+    return func(ReplayTokenizer<ReplaySemicolonDialect>{});
+  case ReplayDialect::pipe:
+    return func(ReplayTokenizer<ReplayPipeDialect>{});
+  default:
+    return func(ReplayTokenizer<ReplayCommaDialect>{});
+  }
+}
+
+// Guess the dialect from a sample of the file (typically its first few KB).
+// The delimiter that splits every sampled line into the same number of
+// fields, and the most fields, wins; comma is the fallback.
+inline ReplayDialect replay_sniff_dialect(std::string_view sample) {
+  static const std::pair<char, ReplayDialect> candidates[] = {
+      {',', ReplayDialect::comma},
+      {'\t', ReplayDialect::tab},
+      {';', ReplayDialect::semicolon},
+      {'|', ReplayDialect::pipe}};
+
+  std::vector<std::string_view> lines;
+  size_t pos = 0;
+  while (pos < sample.size()) {
+    size_t start = pos;
+    std::string_view line =
+        ReplayCsv::next_line(sample.data(), sample.size(), pos);
+    bool truncated = pos == sample.size() && sample.back() != '\n';
+    if (truncated && !lines.empty() && start > 0) {
+      break; // partial last line
+    }
+    if (!ReplayTokenizer<ReplayCommaDialect>::is_ignorable_line(line)) {
+      lines.push_back(line);
+    }
+  }
+
+  ReplayDialect best = ReplayDialect::comma;
+  size_t best_count = 0;
+  for (const auto &[delimiter, dialect] : candidates) {
+    size_t expected = 0;
+    bool consistent = true;
+    for (size_t l = 0; l < lines.size() && consistent; ++l) {
+      size_t count = 0;
+      bool in_quotes = false;
+      for (char c : lines[l]) {
+        if (c == '"') {
+          in_quotes = !in_quotes;
+        } else if (c == delimiter && !in_quotes) {
+          ++count;
+        }
+      }
+      if (l == 0) {
+        expected = count;
+      } else if (count != expected) {
+        consistent = false;
+      }
+    }
+    if (consistent && expected > best_count) {
+      best = dialect;
+      best_count = expected;
+    }
+  }
+  return best;
+}
+
+// Compiled form of a header line: the original keypaths and one JSON pointer
+// per column, used to build JSON objects from rows
+struct ReplayPlan {
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  std::vector<std::string> keypaths;
+  std::vector<nlohmann::json::json_pointer> pointers;
+  // Columns whose keypath is not a valid JSON pointer or clashes with
+  // another column (e.g. "a" and "a.b"); build() leaves them out
+  std::vector<bool> invalid;
+  size_t invalid_count = 0;
+  // Column lookup by original keypath and by JSON pointer string
+  std::unordered_map<std::string, size_t> lookup;
+  // Shape of the JSON built from a complete row, with 0 at every leaf
+  nlohmann::json skeleton = nlohmann::json::object();
+
+  // Compile the header keypaths. Keypath problems are detected here, once,
+  // so that building rows never throws.
+  static std::shared_ptr<const ReplayPlan>
+  compile(const std::vector<std::string> &keypaths) {
+    auto plan = std::make_shared<ReplayPlan>();
+    plan->keypaths = keypaths;
+    plan->pointers.reserve(keypaths.size());
+    plan->invalid.assign(keypaths.size(), false);
+    nlohmann::json &skeleton = plan->skeleton;
+    for (size_t i = 0; i < keypaths.size(); ++i) {
+      plan->lookup.emplace(keypaths[i], i);
+      try {
+        plan->pointers.emplace_back(ReplayCsv::normalize_keypath(keypaths[i]));
+        const auto &pointer = plan->pointers.back();
+        // A leaf must not replace a container built by earlier columns, and
+        // later columns must not descend into a leaf
+        if (skeleton.contains(pointer) && skeleton.at(pointer).is_structured()) {
+          throw std::invalid_argument("keypath clashes with another column");
+        }
+        skeleton[pointer] = 0;
+        plan->lookup.emplace(pointer.to_string(), i);
+      } catch (const std::exception &) {
+        if (plan->pointers.size() == i) {
+          plan->pointers.emplace_back();
+        }
+        plan->invalid[i] = true;
+        plan->invalid_count++;
+      }
+    }
+    return plan;
+  }
+
+  size_t size() const { return pointers.size(); }
+
+  // Index of the column with the given keypath (in CSV or JSON pointer
+  // notation), or npos
+  size_t column_index(const std::string &keypath) const {
+    auto it = lookup.find(keypath);
+    if (it == lookup.end()) {
+      it = lookup.find(ReplayCsv::normalize_keypath(keypath));
+    }
+    return it == lookup.end() ? npos : it->second;
+  }
+
+  nlohmann::json build(const std::vector<std::string> &row) const {
+    nlohmann::json result = nlohmann::json::object();
+    for (size_t i = 0; i < pointers.size() && i < row.size(); ++i) {
+      if (invalid_count && invalid[i]) {
+        continue;
+      }
+      const std::string &value = row[i];
+      if (ReplayCsv::is_numeric(value)) {
+        result[pointers[i]] = ReplayCsv::parse_number(value);
+      } else {
+        result[pointers[i]] = value;
+      }
+    }
+    return result;
+  }
+};
+
+// Process-wide cache of compiled header plans. Files with identical header
+// lines (and dialect) share one immutable plan, so opening many small files
+// with the same layout skips keypath normalization and pointer building.
+// Entries are weak: a plan is freed when no source uses it any more.
+class ReplayPlanCache {
+public:
+  template <typename Compile>
+  static std::shared_ptr<const ReplayPlan>
+  get(ReplayDialect dialect, std::string_view header_line, Compile &&compile) {
+    ReplayPlanCache &cache = instance();
+    if (!cache._enabled) {
+      return compile();
+    }
+    std::string key;
+    key.reserve(header_line.size() + 1);
+    key.push_back(static_cast<char>('0' + static_cast<int>(dialect)));
+    key.append(header_line);
+
+    std::lock_guard<std::mutex> lock(cache._mutex);
+    auto it = cache._plans.find(key);
+    if (it != cache._plans.end()) {
+      if (auto plan = it->second.lock()) {
+        cache._hits++;
+        return plan;
+      }
+    }
+    cache._misses++;
+    auto plan = compile();
+    if (cache._plans.size() >= cache._prune_at) {
+      prune(cache);
+    }
+    cache._plans[key] = plan;
+    return plan;
+  }
+
+  static void set_enabled(bool enabled) { instance()._enabled = enabled; }
+
+  static size_t hits() {
+    std::lock_guard<std::mutex> lock(instance()._mutex);
+    return instance()._hits;
+  }
+
+  static size_t misses() {
+    std::lock_guard<std::mutex> lock(instance()._mutex);
+    return instance()._misses;
+  }
+
+  // Number of plans currently alive
+  static size_t size() {
+    ReplayPlanCache &cache = instance();
+    std::lock_guard<std::mutex> lock(cache._mutex);
+    prune(cache);
+    return cache._plans.size();
+  }
+
+private:
+  std::mutex _mutex;
+  std::unordered_map<std::string, std::weak_ptr<const ReplayPlan>> _plans;
+  std::atomic<bool> _enabled{true};
+  size_t _hits = 0;
+  size_t _misses = 0;
+  size_t _prune_at = 64;
+
+  static ReplayPlanCache &instance() {
+    static ReplayPlanCache cache;
+    return cache;
+  }
+
+  // Drop expired entries; called with the mutex held
+  static void prune(ReplayPlanCache &cache) {
+    for (auto it = cache._plans.begin(); it != cache._plans.end();) {
+      it = it->second.expired() ? cache._plans.erase(it) : std::next(it);
+    }
+    cache._prune_at = std::max<size_t>(64, 2 * cache._plans.size());
+  }
+};
+
+// Outcome of reading one data row
+enum class ReplayRowStatus { ok, too_few_fields, too_many_fields };
+
+// What a cursor does with rows whose field count does not match the header:
+// return them anyway with last_status() set (flag, the default), drop them
+// (skip), or drop them and append them to a side file (quarantine)
+enum class ReplayErrorPolicy { flag, skip, quarantine };
+
+// Counters kept while reading
+struct ReplayStatistics {
+  size_t rows = 0;            // rows returned
+  size_t bytes = 0;           // bytes of data lines read
+  size_t too_few_fields = 0;  // malformed rows, whatever the policy
+  size_t too_many_fields = 0;
+  size_t skipped = 0;         // malformed rows not returned
+  size_t quarantined = 0;     // malformed rows written to the side file
+  size_t bad_columns = 0;     // header keypaths left out of the JSON
+  size_t late = 0;            // rows dropped by the reorder buffer
+  size_t unmatched = 0;       // rows without a match in the join table
+
+  size_t errors() const { return too_few_fields + too_many_fields; }
+};
+
+// Side file collecting malformed rows as "<line>\t<reason>\t<raw row>".
+// Can be shared by cursors running on different threads.
+class ReplayQuarantine {
+public:
+  explicit ReplayQuarantine(const std::string &path) : _file(path) {
+    if (!_file.is_open()) {
+      throw std::runtime_error("Failed to open quarantine file: " + path);
+    }
+  }
+
+  // Returns false if the row could not be written
+  bool write(size_t line_number, ReplayRowStatus status,
+             std::string_view line) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _file << line_number << '\t'
+          << (status == ReplayRowStatus::too_few_fields ? "too_few_fields"
+                                                        : "too_many_fields")
+          << '\t' << line << '\n';
+    return static_cast<bool>(_file);
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _file.flush();
+  }
+
+private:
+  std::mutex _mutex;
+  std::ofstream _file;
+};
+
+// Opt-in recording of pipeline spans, written as Chrome trace JSON (viewable
+// in Perfetto or chrome://tracing). Each thread appends to its own buffer
+// without locking; buffers are only read by write(). When tracing is off, a
+// span costs one relaxed atomic load.
+class ReplayTrace {
+public:
+  // Start recording; write() only reports spans begun after this call
+  static void start() {
+    registry().origin.store(now(), std::memory_order_relaxed);
+    registry().enabled.store(true, std::memory_order_release);
+  }
+
+  static void stop() {
+    registry().enabled.store(false, std::memory_order_release);
+  }
+
+  static bool enabled() {
+    return registry().enabled.load(std::memory_order_relaxed);
+  }
+
+  // Name shown for the calling thread in the trace viewer
+  static void set_thread_name(const std::string &name) {
+    thread_name() = name;
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (auto &buffer : r.buffers) {
+      if (buffer->thread == std::this_thread::get_id()) {
+        buffer->name = name;
+      }
+    }
+  }
+
+  static uint64_t now() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+  }
+
+  // Record a span of the calling thread; name must be a string literal
+  static void record(const char *name, uint64_t begin, uint64_t end) {
+    Buffer &buffer = local_buffer();
+    Chunk *chunk = buffer.tail;
+    size_t n = chunk->count.load(std::memory_order_relaxed);
+    if (n == Chunk::capacity) {
+      chunk = new Chunk();
+      buffer.tail->next.store(chunk, std::memory_order_release);
+      buffer.tail = chunk;
+      n = 0;
+    }
+    chunk->events[n] = Event{name, begin, end};
+    chunk->count.store(n + 1, std::memory_order_release);
+  }
+
+  // Write the spans recorded since start() as Chrome trace JSON. Returns
+  // the number of spans written.
+  static size_t write(const std::string &path) {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+      throw std::runtime_error("Failed to open trace file: " + path);
+    }
+    Registry &r = registry();
+    const uint64_t origin = r.origin.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(r.mutex);
+    size_t written = 0;
+    char entry[256];
+    out << "{\"traceEvents\":[";
+    const char *separator = "\n";
+    for (size_t t = 0; t < r.buffers.size(); ++t) {
+      const Buffer &buffer = *r.buffers[t];
+      if (!buffer.name.empty()) {
+        out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            << "\"tid\":" << t + 1 << ",\"args\":{\"name\":"
+            << nlohmann::json(buffer.name).dump() << "}}";
+        separator = ",\n";
+      }
+      for (const Chunk *chunk = &buffer.head; chunk;
+           chunk = chunk->next.load(std::memory_order_acquire)) {
+        const size_t n = chunk->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < n; ++i) {
+          const Event &e = chunk->events[i];
+          if (e.begin < origin) {
+            continue;
+          }
+          std::snprintf(entry, sizeof(entry),
+                        "%s{\"name\":\"%s\",\"cat\":\"replay\",\"ph\":\"X\","
+                        "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%zu}",
+                        separator, e.name, (e.begin - origin) / 1e3,
+                        (e.end - e.begin) / 1e3, t + 1);
+          out << entry;
+          separator = ",\n";
+          ++written;
+        }
+      }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    if (!out) {
+      throw std::runtime_error("Failed to write trace file: " + path);
+    }
+    return written;
+  }
+
+private:
+  struct Event {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  // Single writer (the owning thread), readers follow count and next
+  struct Chunk {
+    static constexpr size_t capacity = 4096;
+    Event events[capacity];
+    std::atomic<size_t> count{0};
+    std::atomic<Chunk *> next{nullptr};
+  };
+
+  struct Buffer {
+    std::thread::id thread;
+    std::string name;
+    Chunk head;
+    Chunk *tail = &head;
+
+    ~Buffer() {
+      Chunk *chunk = head.next.load();
+      while (chunk) {
+        Chunk *next = chunk->next.load();
+        delete chunk;
+        chunk = next;
+      }
+    }
+  };
+
+  // Buffers outlive their threads, so spans of finished threads are kept
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    std::atomic<bool> enabled{false};
+    std::atomic<uint64_t> origin{0};
+  };
+
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+  static std::string &thread_name() {
+    thread_local std::string name;
+    return name;
+  }
+
+  static Buffer &local_buffer() {
+    thread_local Buffer *buffer = nullptr;
+    if (!buffer) {
+      auto created = std::make_unique<Buffer>();
+      created->thread = std::this_thread::get_id();
+      created->name = thread_name();
+      Registry &r = registry();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.buffers.push_back(std::move(created));
+      buffer = r.buffers.back().get();
+    }
+    return *buffer;
+  }
+};
+
+// Scoped span recorded by ReplayTrace when tracing is on
+class ReplayTraceSpan {
+public:
+  explicit ReplayTraceSpan(const char *name)
+      : _name(ReplayTrace::enabled() ? name : nullptr),
+        _begin(_name ? ReplayTrace::now() : 0) {}
+
+  ~ReplayTraceSpan() {
+    if (_name) {
+      ReplayTrace::record(_name, _begin, ReplayTrace::now());
+    }
+  }
+
+  ReplayTraceSpan(const ReplayTraceSpan &) = delete;
+  ReplayTraceSpan &operator=(const ReplayTraceSpan &) = delete;
+
+private:
+  const char *_name;
+  uint64_t _begin;
+};
+
+// Part of a file under one header. Loggers restarted with a different set
+// of columns may write a new header line into the same file: a line whose
+// first field repeats the name of the first column starts a new segment.
+struct ReplaySegment {
+  size_t offset = 0;    // byte offset of the header line
+  size_t first_row = 0; // index of the segment's first data row
+  std::shared_ptr<const ReplayPlan> plan;
+};
+
+// Immutable, shareable view of a CSV file: the mapped data, the compiled
+// header plan and a row index (built on first use). A single source can be
+// read concurrently by any number of ReplayCursor objects.
+class ReplaySource {
+public:
+  // Bytes inspected by the dialect sniffer
+  static constexpr size_t sniff_size = 4096;
+
+  static std::shared_ptr<const ReplaySource>
+  open(const std::string &path,
+       ReplayDialect dialect = ReplayDialect::automatic,
+       ReplayHugePages pages = ReplayHugePages::none) {
+    return std::make_shared<const ReplaySource>(path, dialect, pages);
+  }
+
+  explicit ReplaySource(const std::string &path,
+                        ReplayDialect dialect = ReplayDialect::automatic,
+                        ReplayHugePages pages = ReplayHugePages::none)
+      : _path(path), _file(path, pages), _dialect(dialect), _pages(pages) {
+    if (_dialect == ReplayDialect::automatic) {
+      _dialect = replay_sniff_dialect(
+          std::string_view(data(), std::min(size(), sniff_size)));
+    }
+    parse_headers();
+  }
+
+  ReplaySource(const ReplaySource &) = delete;
+  ReplaySource &operator=(const ReplaySource &) = delete;
+
+  const std::string &path() const { return _path; }
+  // Plan of the first header. Rows of later segments are built with their
+  // own plan (see segments() and ReplayCursor::plan()).
+  const ReplayPlan &plan() const { return *_plan; }
+  const std::shared_ptr<const ReplayPlan> &shared_plan() const { return _plan; }
+  const char *data() const { return _file.data(); }
+  size_t size() const { return _file.size(); }
+
+  // Ask the OS to read a byte range ahead of its use
+  void prefetch(size_t offset, size_t length) const {
+    _file.prefetch(offset, length);
+  }
+
+  // Dialect in use (never automatic: sniffed dialects are resolved on open)
+  ReplayDialect dialect() const { return _dialect; }
+
+  // Huge pages requested on open
+  ReplayHugePages huge_pages() const { return _pages; }
+
+  // True if the data was placed in explicit (MAP_HUGETLB) huge pages
+  bool hugetlb() const { return _file.hugetlb(); }
+
+  // Bytes of the data and of the row index actually backed by huge pages
+  size_t huge_page_bytes() const {
+    size_t bytes = _file.huge_page_bytes();
+    if (_index_built.load(std::memory_order_acquire)) {
+      bytes += ReplayMappedFile::huge_page_bytes(
+          _index.data(), _index.size() * sizeof(size_t));
+    }
+    return bytes;
+  }
+
+  // Call func with the tokenizer specialized for this source's dialect
+  template <typename Func> decltype(auto) with_tokenizer(Func &&func) const {
+    return replay_visit_dialect(_dialect, std::forward<Func>(func));
+  }
+
+  // Byte offset of the first line after the header
+  size_t data_begin() const { return _data_begin; }
+
+  // Byte offsets of every data row (comments and empty lines excluded).
+  // Built once, on first call, in a thread-safe way.
+  const std::vector<size_t> &row_index() const {
+    std::call_once(_index_once, [this]() { build_index(); });
+    return _index;
+  }
+
+  size_t row_count() const { return row_index().size(); }
+
+  size_t row_offset(size_t row) const { return row_index().at(row); }
+
+  // Schema segments, in file order; the first one starts at the first
+  // header. Found while building the row index.
+  const std::vector<ReplaySegment> &segments() const {
+    row_index();
+    return _segments;
+  }
+
+  // Segment holding the given data row
+  const ReplaySegment &segment_of(size_t row) const {
+    const auto &segments = this->segments();
+    auto it = std::upper_bound(
+        segments.begin(), segments.end(), row,
+        [](size_t r, const ReplaySegment &s) { return r < s.first_row; });
+    return *(it - 1);
+  }
+
+  // Segment holding the line at the given byte offset
+  const ReplaySegment &segment_at(size_t offset) const {
+    const auto &segments = this->segments();
+    auto it = std::upper_bound(
+        segments.begin(), segments.end(), offset,
+        [](size_t o, const ReplaySegment &s) { return o < s.offset; });
+    return it == segments.begin() ? *it : *(it - 1);
+  }
+
+  // True if line is a later header line: its first field is the name of
+  // the first column (and, for single-column files, the whole line is)
+  bool is_header_line(std::string_view line) const {
+    if (_header_key.empty() || line.size() < _header_key.size() ||
+        std::memcmp(line.data(), _header_key.data(), _header_key.size()) != 0) {
+      return false;
+    }
+    return _header_key.back() == _delimiter || line.size() == _header_key.size();
+  }
+
+  // Compiled plan of a header line (shared through ReplayPlanCache)
+  std::shared_ptr<const ReplayPlan> plan_for(std::string_view header_line) const {
+    return with_tokenizer([this, header_line](auto tokenizer) {
+      return ReplayPlanCache::get(_dialect, header_line, [&]() {
+        return ReplayPlan::compile(tokenizer.parse_csv_line(header_line));
+      });
+    });
+  }
+
+private:
+  std::string _path;
+  ReplayMappedFile _file;
+  ReplayDialect _dialect;
+  ReplayHugePages _pages;
+  std::shared_ptr<const ReplayPlan> _plan;
+  size_t _data_begin = 0;
+  mutable std::once_flag _index_once;
+  mutable std::vector<size_t> _index;
+  mutable std::atomic<bool> _index_built{false};
+  mutable std::vector<ReplaySegment> _segments;
+  std::string _header_key; // first field of the header, with its delimiter
+  char _delimiter = ',';
+
+  void parse_headers() {
+    with_tokenizer([this](auto tokenizer) {
+      size_t pos = 0;
+      while (pos < size()) {
+        std::string_view header_line =
+            ReplayCsv::next_line(data(), size(), pos);
+        // Skip comment lines and empty lines to find the actual header
+        if (tokenizer.is_ignorable_line(header_line)) {
+          continue;
+        }
+        _plan = ReplayPlanCache::get(_dialect, header_line, [&]() {
+          return ReplayPlan::compile(tokenizer.parse_csv_line(header_line));
+        });
+        _data_begin = pos;
+        _segments.push_back(ReplaySegment{
+            static_cast<size_t>(header_line.data() - data()), 0, _plan});
+        // Key for spotting later headers; an unnamed first column cannot
+        // be told from data
+        std::vector<std::string_view> spans;
+        tokenizer.locate_fields(header_line, spans);
+        if (!spans[0].empty()) {
+          _header_key = std::string(
+              header_line.substr(0, spans.size() > 1
+                                        ? spans[1].data() - header_line.data()
+                                        : header_line.size()));
+          _delimiter = spans.size() > 1 ? _header_key.back() : '\0';
+        }
+        return;
+      }
+
+      throw std::runtime_error("CSV file is empty or cannot read header line");
+    });
+  }
+
+  void build_index() const {
+    with_tokenizer([this](auto tokenizer) {
+      size_t pos = _data_begin;
+      while (pos < size()) {
+        size_t start = pos;
+        std::string_view line = ReplayCsv::next_line(data(), size(), pos);
+        if (tokenizer.is_ignorable_line(line)) {
+          continue;
+        }
+        if (is_header_line(line)) {
+          _segments.push_back(
+              ReplaySegment{start, _index.size(), plan_for(line)});
+          continue;
+        }
+        _index.push_back(start);
+      }
+    });
+    if (_pages != ReplayHugePages::none && !_index.empty()) {
+      // Move the index into memory advised for huge pages before it is
+      // first touched, so that random seeks do not miss the TLB
+      std::vector<size_t> index;
+      index.reserve(_index.size());
+      ReplayMappedFile::advise_huge(index.data(),
+                                    _index.size() * sizeof(size_t));
+      index.assign(_index.begin(), _index.end());
+      _index.swap(index);
+    }
+    _index_built.store(true, std::memory_order_release);
+  }
+};
+
+// CRC32C (Castagnoli), with the SSE4.2 instruction when the CPU has it and
+// a slice-by-8 table otherwise
+struct ReplayChecksum {
+  static uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0) {
+#if REPLAY_CRC32C_X86
+    if (hardware()) {
+      return crc32c_sse42(data, size, crc);
+    }
+#endif
+    return crc32c_table(data, size, crc);
+  }
+
+  // True if crc32c() uses the CPU instruction
+  static bool hardware() {
+#if REPLAY_CRC32C_X86
+    static const bool supported = __builtin_cpu_supports("sse4.2");
+    return supported;
+#else
+    return false;
+#endif
+  }
+
+  static uint32_t crc32c_table(const void *data, size_t size, uint32_t crc) {
+    static const auto tables = make_tables();
+    const auto *p = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (; size >= 8; size -= 8, p += 8) {
+      uint32_t lo;
+      uint32_t hi;
+      std::memcpy(&lo, p, 4);
+      std::memcpy(&hi, p + 4, 4);
+      lo ^= crc; // little-endian byte order assumed
+      crc = tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff] ^
+            tables[5][(lo >> 16) & 0xff] ^ tables[4][lo >> 24] ^
+            tables[3][hi & 0xff] ^ tables[2][(hi >> 8) & 0xff] ^
+            tables[1][(hi >> 16) & 0xff] ^ tables[0][hi >> 24];
+    }
+    for (; size > 0; --size, ++p) {
+      crc = tables[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+private:
+  using Tables = std::array<std::array<uint32_t, 256>, 8>;
+
+  static Tables make_tables() {
+    Tables tables;
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; ++k) {
+        crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1u)));
+      }
+      tables[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (size_t t = 1; t < 8; ++t) {
+        tables[t][i] =
+            (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xff];
+      }
+    }
+    return tables;
+  }
+
+#if REPLAY_CRC32C_X86
+  __attribute__((target("sse4.2"))) static uint32_t
+  crc32c_sse42(const void *data, size_t size, uint32_t crc) {
+    const auto *p = static_cast<const uint8_t *>(data);
+    uint64_t c = ~crc;
+    for (; size >= 8; size -= 8, p += 8) {
+      uint64_t word;
+      std::memcpy(&word, p, 8);
+      c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for (; size > 0; --size, ++p) {
+      c32 = _mm_crc32_u8(c32, *p);
+    }
+    return ~c32;
+  }
+#endif
+};
+
+// Raised by a cursor reading a block whose checksum does not match the one
+// recorded in the sidecar file
+class ReplayChecksumError : public std::runtime_error {
+public:
+  ReplayChecksumError(const std::string &path, size_t block, size_t offset,
+                      size_t length)
+      : std::runtime_error("Checksum mismatch in " + path + ", block " +
+                           std::to_string(block) + " (bytes " +
+                           std::to_string(offset) + "-" +
+                           std::to_string(offset + length) + ")"),
+        _block(block), _offset(offset), _length(length) {}
+
+  size_t block() const { return _block; }
+  size_t offset() const { return _offset; }
+  size_t length() const { return _length; }
+
+private:
+  size_t _block;
+  size_t _offset;
+  size_t _length;
+};
+
+// Per-block CRC32C checksums of a source, kept in a sidecar file next to
+// it (<path>.crc). Cursors with an integrity check verify every block the
+// first time they read from it. Without a sidecar, the checksums of the
+// blocks read are recorded instead, and the sidecar is written once every
+// block has been seen (or on save()); later replays verify against it. A
+// sidecar is only trusted for a file of the same size and modification
+// time, so rewriting a log discards it. Can be shared by cursors running on
+// different threads.
+class ReplayIntegrity {
+public:
+  static constexpr size_t default_block_size = 1u << 20;
+
+  explicit ReplayIntegrity(std::shared_ptr<const ReplaySource> source,
+                           size_t block_size = default_block_size)
+      : _source(std::move(source)), _block_size(block_size),
+        _path(_source ? _source->path() + ".crc" : "") {
+    if (!_source) {
+      throw std::invalid_argument("ReplayIntegrity requires a source");
+    }
+    if (_block_size == 0) {
+      throw std::invalid_argument("Checksum block size must be positive");
+    }
+    _count = (_source->size() + _block_size - 1) / _block_size;
+    _sums.reset(new std::atomic<uint32_t>[_count]);
+    _states.reset(new std::atomic<uint8_t>[_count]);
+    for (size_t b = 0; b < _count; ++b) {
+      _sums[b].store(0, std::memory_order_relaxed);
+      _states[b].store(unknown, std::memory_order_relaxed);
+    }
+    _mtime = modified_time(_source->path());
+    _loaded = load();
+  }
+
+  ReplayIntegrity(const ReplayIntegrity &) = delete;
+  ReplayIntegrity &operator=(const ReplayIntegrity &) = delete;
+
+  // Write the sidecar if this run recorded the checksums of every block
+  ~ReplayIntegrity() {
+    if (!_loaded && _seen.load() == _count) {
+      try {
+        save();
+      } catch (const std::exception &) {
+      }
+    }
+  }
+
+  const ReplaySource &source() const { return *_source; }
+  const std::string &sidecar_path() const { return _path; }
+  size_t block_size() const { return _block_size; }
+  size_t block_count() const { return _count; }
+
+  // True if the checksums were read from the sidecar, so that blocks are
+  // verified rather than recorded
+  bool loaded() const { return _loaded; }
+
+  // Blocks verified (or recorded) so far
+  size_t checked() const { return _seen.load(); }
+
+  // Check every block overlapping [begin, end). Returns the end of the
+  // last block checked; throws ReplayChecksumError on a mismatch.
+  size_t check(size_t begin, size_t end) {
+    const size_t last = std::min(_count, (end + _block_size - 1) / _block_size);
+    for (size_t b = begin / _block_size; b < last; ++b) {
+      check_block(b);
+    }
+    return std::min(_source->size(), last * _block_size);
+  }
+
+  // Check the whole file
+  void check_all() { check(0, _source->size()); }
+
+  // Write the sidecar, computing the checksums of the blocks not read yet
+  // (blocks found corrupt keep their recorded checksum)
+  void save() {
+    std::vector<uint32_t> sums(_count);
+    for (size_t b = 0; b < _count; ++b) {
+      if (_states[b].load(std::memory_order_acquire) == unknown) {
+        check_block(b);
+      }
+      sums[b] = _sums[b].load(std::memory_order_relaxed);
+    }
+    const std::string temp = _path + ".tmp";
+    {
+      std::ofstream out(temp, std::ios::binary);
+      const uint64_t header[4] = {_block_size, _source->size(),
+                                  static_cast<uint64_t>(_mtime), _count};
+      out.write(magic, sizeof(magic));
+      out.write(reinterpret_cast<const char *>(header), sizeof(header));
+      out.write(reinterpret_cast<const char *>(sums.data()),
+                sums.size() * sizeof(uint32_t));
+      if (!out) {
+        throw std::runtime_error("Failed to write checksum file: " + temp);
+      }
+    }
+    if (std::rename(temp.c_str(), _path.c_str()) != 0) {
+      throw std::runtime_error("Failed to replace checksum file: " + _path);
+    }
+  }
+
+private:
+  // Block states: no checksum yet, checksum from the sidecar to verify,
+  // verified or recorded, mismatching
+  enum : uint8_t { unknown, expected, good, corrupt };
+  static constexpr char magic[8] = {'R', 'P', 'L', 'Y', 'C', 'R', 'C', '1'};
+
+  std::shared_ptr<const ReplaySource> _source;
+  size_t _block_size;
+  std::string _path;
+  size_t _count = 0;
+  int64_t _mtime = 0;
+  bool _loaded = false;
+  std::unique_ptr<std::atomic<uint32_t>[]> _sums;
+  std::unique_ptr<std::atomic<uint8_t>[]> _states;
+  std::atomic<size_t> _seen{0};
+
+  // Modification time of a file in nanoseconds (0 if unknown)
+  static int64_t modified_time(const std::string &path) {
+#if defined(_WIN32)
+    struct _stat64 st;
+    if (::_stat64(path.c_str(), &st) == 0) {
+      return static_cast<int64_t>(st.st_mtime) * 1000000000;
+    }
+#else
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0) {
+#if defined(__APPLE__)
+      return static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 +
+             st.st_mtimespec.tv_nsec;
+#else
+      return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+             st.st_mtim.tv_nsec;
+#endif
+    }
+#endif
+    return 0;
+  }
+
+  void check_block(size_t b) {
+    uint8_t state = _states[b].load(std::memory_order_acquire);
+    if (state == good) {
+      return;
+    }
+    const size_t offset = b * _block_size;
+    const size_t length = std::min(_block_size, _source->size() - offset);
+    if (state == corrupt) {
+      throw ReplayChecksumError(_source->path(), b, offset, length);
+    }
+    uint32_t crc;
+    {
+      ReplayTraceSpan span("checksum");
+      crc = ReplayChecksum::crc32c(_source->data() + offset, length);
+    }
+    if (state == unknown) {
+      _sums[b].store(crc, std::memory_order_relaxed);
+    } else if (crc != _sums[b].load(std::memory_order_relaxed)) {
+      _states[b].store(corrupt, std::memory_order_release);
+      throw ReplayChecksumError(_source->path(), b, offset, length);
+    }
+    // Concurrent checks of a block agree; count it once
+    if (_states[b].exchange(good, std::memory_order_acq_rel) != good) {
+      _seen++;
+    }
+  }
+
+  bool load() {
+    std::ifstream in(_path, std::ios::binary);
+    char file_magic[sizeof(magic)];
+    uint64_t header[4];
+    if (!in.read(file_magic, sizeof(file_magic)) ||
+        std::memcmp(file_magic, magic, sizeof(magic)) != 0 ||
+        !in.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+        header[0] != _block_size || header[1] != _source->size() ||
+        header[2] != static_cast<uint64_t>(_mtime) || header[3] != _count) {
+      return false; // missing, stale or written with another block size
+    }
+    std::vector<uint32_t> sums(_count);
+    if (!in.read(reinterpret_cast<char *>(sums.data()),
+                 sums.size() * sizeof(uint32_t))) {
+      return false;
+    }
+    for (size_t b = 0; b < _count; ++b) {
+      _sums[b].store(sums[b], std::memory_order_relaxed);
+      _states[b].store(expected, std::memory_order_relaxed);
+    }
+    return true;
+  }
+};
+
+// Arithmetic expression over the columns of a plan, e.g.
+//   speed / 3.6
+//   sqrt(acceleration.x^2 + acceleration.y^2 + acceleration.z^2)
+// Operators are + - * / % ^ (power, right associative) and unary minus;
+// functions are abs, sqrt, exp, log, log10, sin, cos, tan, asin, acos,
+// atan, floor, ceil, round, min, max, atan2, pow and hypot. Column keypaths
+// are written as in the header; keypaths with other characters go between
+// backquotes. The text is parsed once into stack bytecode, which runs on
+// the column values as doubles (NaN for fields that are not numbers).
+class ReplayExpression {
+public:
+  ReplayExpression(const std::string &text, const ReplayPlan &plan)
+      : _text(text) {
+    Parser parser{text, plan, *this};
+    parser.parse();
+  }
+
+  const std::string &text() const { return _text; }
+
+  // Plan columns read by the expression
+  const std::vector<size_t> &columns() const { return _columns; }
+
+  // Evaluate on one row; values is indexed by plan column, and only the
+  // entries of columns() are read
+  double evaluate(const double *values) const {
+    double small[16];
+    std::vector<double> large;
+    double *stack = small;
+    if (_depth > 16) {
+      large.resize(_depth);
+      stack = large.data();
+    }
+    size_t top = 0; // number of values on the stack
+    for (const Op &op : _code) {
+      switch (op.code) {
+      case Code::constant:
+        stack[top++] = op.value;
+        break;
+      case Code::column:
+        stack[top++] = values[op.arg];
+        break;
+      case Code::negate:
+        stack[top - 1] = -stack[top - 1];
+        break;
+      case Code::call1:
+        stack[top - 1] = apply1(op.arg, stack[top - 1]);
+        break;
+      default: // binary
+        --top;
+        stack[top - 1] = apply2(op.code, op.arg, stack[top - 1], stack[top]);
+        break;
+      }
+    }
+    return stack[0];
+  }
+
+  // Evaluate on a batch of n rows, one operation at a time over the whole
+  // batch, so that the loops can be vectorized. columns[c] points to the n
+  // values of plan column c (only the entries of columns() are read).
+  void evaluate(const double *const *columns, size_t n, double *out) const {
+    std::vector<double> registers(_depth * n);
+    size_t top = 0;
+    for (const Op &op : _code) {
+      double *a = registers.data() + (top - (op.code >= Code::negate)) * n;
+      double *b = a + n;
+      switch (op.code) {
+      case Code::constant:
+        std::fill(a, a + n, op.value);
+        ++top;
+        break;
+      case Code::column:
+        std::copy(columns[op.arg], columns[op.arg] + n, a);
+        ++top;
+        break;
+      case Code::negate:
+        for (size_t i = 0; i < n; ++i) {
+          a[i] = -a[i];
+        }
+        break;
+      case Code::call1:
+        for (size_t i = 0; i < n; ++i) {
+          a[i] = apply1(op.arg, a[i]);
+        }
+        break;
+      case Code::add:
+        a -= n, b -= n;
+        for (size_t i = 0; i < n; ++i) {
+          a[i] += b[i];
+        }
+        --top;
+        break;
+      case Code::subtract:
+        a -= n, b -= n;
+        for (size_t i = 0; i < n; ++i) {
+          a[i] -= b[i];
+        }
+        --top;
+        break;
+      case Code::multiply:
+        a -= n, b -= n;
+        for (size_t i = 0; i < n; ++i) {
+          a[i] *= b[i];
+        }
+        --top;
+        break;
+      case Code::divide:
+        a -= n, b -= n;
+        for (size_t i = 0; i < n; ++i) {
+          a[i] /= b[i];
+        }
+        --top;
+        break;
+      default:
+        a -= n, b -= n;
+        for (size_t i = 0; i < n; ++i) {
+          a[i] = apply2(op.code, op.arg, a[i], b[i]);
+        }
+        --top;
+        break;
+      }
+    }
+    std::copy(registers.data(), registers.data() + n, out);
+  }
+
+private:
+  // Operations with an operand on the stack come after negate
+  enum class Code {
+    constant,
+    column,
+    negate,
+    call1,
+    add,
+    subtract,
+    multiply,
+    divide,
+    modulo,
+    power,
+    call2
+  };
+
+  struct Op {
+    Code code;
+    size_t arg;   // column, or function
+    double value; // constant
+  };
+
+  std::string _text;
+  std::vector<Op> _code;
+  std::vector<size_t> _columns;
+  size_t _depth = 0;
+
+  static constexpr const char *functions1[] = {
+      "abs",  "sqrt", "exp",  "log",  "log10", "sin",   "cos",
+      "tan",  "asin", "acos", "atan", "floor", "ceil",  "round"};
+  static constexpr const char *functions2[] = {"min", "max", "atan2", "pow",
+                                               "hypot"};
+
+  static double apply1(size_t f, double x) {
+    switch (f) {
+    case 0: return std::fabs(x);
+    case 1: return std::sqrt(x);
+    case 2: return std::exp(x);
+    case 3: return std::log(x);
+    case 4: return std::log10(x);
+    case 5: return std::sin(x);
+    case 6: return std::cos(x);
+    case 7: return std::tan(x);
+    case 8: return std::asin(x);
+    case 9: return std::acos(x);
+    case 10: return std::atan(x);
+    case 11: return std::floor(x);
+    case 12: return std::ceil(x);
+    default: return std::round(x);
+    }
+  }
+
+  static double apply2(Code code, size_t f, double x, double y) {
+    switch (code) {
+    case Code::add: return x + y;
+    case Code::subtract: return x - y;
+    case Code::multiply: return x * y;
+    case Code::divide: return x / y;
+    case Code::modulo: return std::fmod(x, y);
+    case Code::power: return std::pow(x, y);
+    default:
+      switch (f) {
+      case 0: return std::fmin(x, y);
+      case 1: return std::fmax(x, y);
+      case 2: return std::atan2(x, y);
+      case 3: return std::pow(x, y);
+      default: return std::hypot(x, y);
+      }
+    }
+  }
+
+  // Recursive descent parser emitting bytecode in postfix order
+  struct Parser {
+    const std::string &text;
+    const ReplayPlan &plan;
+    ReplayExpression &expr;
+    size_t pos = 0;
+    size_t depth = 0;
+
+    void parse() {
+      expression();
+      skip_space();
+      if (pos < text.size()) {
+        fail("unexpected '" + std::string(1, text[pos]) + "'");
+      }
+    }
+
+    void expression() {
+      term();
+      while (accept('+') || accept('-')) {
+        const Code code = text[pos - 1] == '+' ? Code::add : Code::subtract;
+        term();
+        emit(code);
+      }
+    }
+
+    void term() {
+      unary();
+      while (accept('*') || accept('/') || accept('%')) {
+        const char c = text[pos - 1];
+        unary();
+        emit(c == '*' ? Code::multiply : c == '/' ? Code::divide : Code::modulo);
+      }
+    }
+
+    // -x^2 is -(x^2), and 2^-1 is allowed
+    void unary() {
+      if (accept('-')) {
+        unary();
+        emit(Code::negate);
+      } else if (accept('+')) {
+        unary();
+      } else {
+        primary();
+        if (accept('^')) {
+          unary();
+          emit(Code::power);
+        }
+      }
+    }
+
+    void primary() {
+      skip_space();
+      if (pos >= text.size()) {
+        fail("unexpected end");
+      }
+      const char c = text[pos];
+      if (accept('(')) {
+        expression();
+        expect(')');
+      } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '.') {
+        number();
+      } else if (c == '`') {
+        const size_t end = text.find('`', pos + 1);
+        if (end == std::string::npos) {
+          fail("unterminated `");
+        }
+        column(text.substr(pos + 1, end - pos - 1));
+        pos = end + 1;
+      } else if (is_name(c)) {
+        const size_t start = pos;
+        while (pos < text.size() && (is_name(text[pos]) || text[pos] == '.' ||
+                                     text[pos] == '[' || text[pos] == ']')) {
+          ++pos;
+        }
+        const std::string name = text.substr(start, pos - start);
+        if (accept('(')) {
+          call(name, start);
+        } else {
+          column(name);
+        }
+      } else {
+        fail("unexpected '" + std::string(1, c) + "'");
+      }
+    }
+
+    void number() {
+      const char *begin = text.c_str() + pos;
+      char *end = nullptr;
+      const double value = std::strtod(begin, &end);
+      if (end == begin) {
+        fail("bad number");
+      }
+      pos += static_cast<size_t>(end - begin);
+      emit(Code::constant, 0, value);
+    }
+
+    void column(const std::string &keypath) {
+      const size_t index = plan.column_index(keypath);
+      if (index == ReplayPlan::npos) {
+        throw std::invalid_argument("Unknown column in expression: " +
+                                    keypath);
+      }
+      if (std::find(expr._columns.begin(), expr._columns.end(), index) ==
+          expr._columns.end()) {
+        expr._columns.push_back(index);
+      }
+      emit(Code::column, index);
+    }
+
+    void call(const std::string &name, size_t start) {
+      size_t arity = 0;
+      if (!accept(')')) {
+        do {
+          expression();
+          ++arity;
+        } while (accept(','));
+        expect(')');
+      }
+      for (size_t f = 0; f < std::size(functions1); ++f) {
+        if (name == functions1[f] && arity == 1) {
+          emit(Code::call1, f);
+          return;
+        }
+      }
+      for (size_t f = 0; f < std::size(functions2); ++f) {
+        if (name == functions2[f] && arity == 2) {
+          emit(Code::call2, f);
+          return;
+        }
+      }
+      pos = start;
+      fail("unknown function " + name + " with " + std::to_string(arity) +
+           " arguments");
+    }
+
+    void emit(Code code, size_t arg = 0, double value = 0.0) {
+      if (code == Code::constant || code == Code::column) {
+        expr._depth = std::max(expr._depth, ++depth);
+      } else if (code > Code::call1) {
+        --depth;
+      }
+      expr._code.push_back(Op{code, arg, value});
+    }
+
+    static bool is_name(char c) {
+      return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    }
+
+    void skip_space() {
+      while (pos < text.size() &&
+             std::isspace(static_cast<unsigned char>(text[pos]))) {
+        ++pos;
+      }
+    }
+
+    bool accept(char c) {
+      skip_space();
+      if (pos < text.size() && text[pos] == c) {
+        ++pos;
+        return true;
+      }
+      return false;
+    }
+
+    void expect(char c) {
+      if (!accept(c)) {
+        fail(std::string("expected '") + c + "'");
+      }
+    }
+
+    [[noreturn]] void fail(const std::string &message) {
+      throw std::invalid_argument("Bad expression \"" + text + "\" at " +
+                                  std::to_string(pos) + ": " + message);
+    }
+  };
+};
+
+// Lookup table joined to a stream of rows, e.g. vehicle id -> model and
+// calibration. The lookup CSV is read once into a hash table keyed by the
+// text of its key column; a streaming row matches when the text of its own
+// key column is byte for byte the same (no number conversion: "01" does not
+// match "1"). The other lookup columns, converted once on load, are then
+// spliced into the row at their keypaths. On duplicate keys the first
+// lookup row wins.
+class ReplayJoin {
+public:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  ReplayJoin(const std::string &path, const std::string &key,
+             ReplayDialect dialect = ReplayDialect::automatic) {
+    auto source = ReplaySource::open(path, dialect);
+    const ReplayPlan &plan = source->plan();
+    const size_t key_column = plan.column_index(key);
+    if (key_column == ReplayPlan::npos) {
+      throw std::invalid_argument("Unknown join key: " + key);
+    }
+    std::vector<size_t> columns;
+    for (size_t i = 0; i < plan.size(); ++i) {
+      if (i != key_column && !plan.invalid[i]) {
+        columns.push_back(i);
+        _keypaths.push_back(plan.keypaths[i]);
+        _pointers.push_back(plan.pointers[i]);
+      }
+    }
+
+    std::vector<std::string> fields;
+    source->with_tokenizer([&](auto tokenizer) {
+      size_t pos = source->data_begin();
+      while (pos < source->size()) {
+        std::string_view line =
+            ReplayCsv::next_line(source->data(), source->size(), pos);
+        if (tokenizer.is_ignorable_line(line)) {
+          continue;
+        }
+        tokenizer.split_line(line, fields);
+        if (key_column >= fields.size()) {
+          continue;
+        }
+        _keys.push_back(std::move(fields[key_column]));
+        if (!_index.emplace(_keys.back(), _values.size()).second) {
+          _keys.pop_back();
+          continue;
+        }
+        std::vector<nlohmann::json> values(columns.size());
+        for (size_t c = 0; c < columns.size(); ++c) {
+          if (columns[c] >= fields.size()) {
+            continue; // short row: the column is not spliced
+          }
+          const std::string &value = fields[columns[c]];
+          if (ReplayCsv::is_numeric(value)) {
+            values[c] = ReplayCsv::parse_number(value);
+          } else {
+            values[c] = value;
+          }
+        }
+        _values.push_back(std::move(values));
+      }
+    });
+  }
+
+  ReplayJoin(const ReplayJoin &) = delete;
+  ReplayJoin &operator=(const ReplayJoin &) = delete;
+
+  // Number of distinct keys
+  size_t size() const { return _values.size(); }
+
+  // Keypaths of the columns spliced into matching rows
+  const std::vector<std::string> &keypaths() const { return _keypaths; }
+
+  // Lookup row for a key, or npos
+  size_t find(std::string_view key) const {
+    auto it = _index.find(key);
+    return it == _index.end() ? npos : it->second;
+  }
+
+  // Values of a lookup row, in keypaths() order (null where the row was short)
+  const std::vector<nlohmann::json> &values(size_t match) const {
+    return _values.at(match);
+  }
+
+  // Copy the columns of a lookup row into row
+  void splice(size_t match, nlohmann::json &row) const {
+    const auto &values = _values[match];
+    for (size_t c = 0; c < values.size(); ++c) {
+      if (!values[c].is_null()) {
+        row[_pointers[c]] = values[c];
+      }
+    }
+  }
+
+private:
+  std::vector<std::string> _keypaths;
+  std::vector<nlohmann::json::json_pointer> _pointers;
+  std::deque<std::string> _keys; // stable storage for the index keys
+  std::unordered_map<std::string_view, size_t> _index;
+  std::vector<std::vector<nlohmann::json>> _values;
+};
+
+// Row whose fields are located but not yet converted. A field is decoded
+// and converted to JSON the first time its keypath is accessed, and cached
+// for later accesses. The row refers to the source's mapped bytes, which it
+// keeps alive.
+class ReplayLazyRow {
+public:
+  ReplayLazyRow() = default;
+
+  // True for the row returned at the end of the source
+  bool empty() const { return !_source; }
+
+  // Number of fields found in the row
+  size_t size() const { return _spans.size(); }
+
+  // Raw text of the whole row
+  std::string_view line() const { return _line; }
+
+  // Raw text of a field, still quoted/escaped as in the file
+  std::string_view raw(size_t column) const { return _spans.at(column); }
+
+  // Decoded and converted value of a field
+  nlohmann::json value(size_t column) const {
+    std::string field;
+    _source->with_tokenizer([this, column, &field](auto tokenizer) {
+      tokenizer.decode_field(_spans.at(column), field);
+    });
+    if (ReplayCsv::is_numeric(field)) {
+      return ReplayCsv::parse_number(field);
+    }
+    return field;
+  }
+
+  // Value at a keypath (CSV or JSON pointer notation): a leaf, or the
+  // subtree made of the columns below it. Returns null if nothing is found.
+  const nlohmann::json &operator[](const std::string &keypath) const {
+    auto it = _cache.find(keypath);
+    if (it != _cache.end()) {
+      return it->second;
+    }
+    return _cache.emplace(keypath, lookup(keypath)).first->second;
+  }
+
+  bool contains(const std::string &keypath) const {
+    return !(*this)[keypath].is_null();
+  }
+
+  // Full materialization, as ReplayCursor::advance() would return it
+  nlohmann::json to_json() const {
+    if (empty()) {
+      return nlohmann::json{};
+    }
+    const ReplayPlan &plan = *_plan;
+    nlohmann::json result = nlohmann::json::object();
+    for (size_t i = 0; i < plan.size() && i < _spans.size(); ++i) {
+      if (!plan.invalid[i]) {
+        result[plan.pointers[i]] = value(i);
+      }
+    }
+    return result;
+  }
+
+private:
+  friend class ReplayCursor;
+
+  std::shared_ptr<const ReplaySource> _source;
+  std::shared_ptr<const ReplayPlan> _plan; // plan of the row's segment
+  std::string_view _line;
+  std::vector<std::string_view> _spans;
+  mutable std::unordered_map<std::string, nlohmann::json> _cache;
+
+  nlohmann::json lookup(const std::string &keypath) const {
+    if (empty()) {
+      return nullptr;
+    }
+    const ReplayPlan &plan = *_plan;
+    size_t column = plan.column_index(keypath);
+    if (column != ReplayPlan::npos) {
+      return column < _spans.size() && !plan.invalid[column]
+                 ? value(column)
+                 : nlohmann::json();
+    }
+    // Not a leaf: gather the columns below the keypath
+    const std::string prefix = ReplayCsv::normalize_keypath(keypath);
+    nlohmann::json tree = nlohmann::json::object();
+    bool found = false;
+    for (size_t i = 0; i < plan.size() && i < _spans.size(); ++i) {
+      if (plan.invalid[i]) {
+        continue;
+      }
+      const std::string pointer = plan.pointers[i].to_string();
+      if (pointer.size() > prefix.size() &&
+          pointer.compare(0, prefix.size(), prefix) == 0 &&
+          (prefix == "/" || pointer[prefix.size()] == '/')) {
+        tree[plan.pointers[i]] = value(i);
+        found = true;
+      }
+    }
+    if (!found) {
+      return nullptr;
+    }
+    return prefix == "/" ? tree
+                         : tree.at(nlohmann::json::json_pointer(prefix));
+  }
+};
+
+// How ReplayCursor::shard() partitions a file among workers
+enum class ReplayShardBy { rows, bytes, key };
+
+// Independent read position over a shared ReplaySource. Cursors never
+// modify the source, so each thread can own one and advance or seek it
+// without any locking.
+class ReplayCursor {
+public:
+  explicit ReplayCursor(std::shared_ptr<const ReplaySource> source)
+      : _source(std::move(source)) {
+    if (!_source) {
+      throw std::invalid_argument("ReplayCursor requires a source");
+    }
+    reset();
+    _row_plan = _plan;
+  }
+
+  // Read the next data row and return it as JSON object
+  // Returns empty JSON object if the end of the source is reached
+  nlohmann::json advance() {
+    nlohmann::json row;
+    if (!next_row(row)) {
+      return nlohmann::json{};
+    }
+    return row;
+  }
+
+  // Read the next data row into row, applying the error policy to malformed
+  // rows. Returns false at the end of the source; last_status() tells
+  // whether the returned row was well formed.
+  bool next_row(nlohmann::json &row) {
+    std::string_view line;
+    while (next_line(line)) {
+      if (parse_row(line, row)) {
+        return true;
+      }
+    }
+    _status = ReplayRowStatus::ok;
+    return false;
+  }
+
+  // Second half of next_row(), for a line just returned by next_line():
+  // tokenize it, apply the error policy and build the row. Returns false
+  // if the policy drops the line.
+  bool parse_row(std::string_view line, nlohmann::json &row) {
+    {
+      ReplayTraceSpan span("tokenize");
+      _source->with_tokenizer([this, line](auto tokenizer) {
+        tokenizer.split_line(line, _fields);
+      });
+    }
+    if (!accept(line, _fields.size())) {
+      return false;
+    }
+    ReplayTraceSpan span("build");
+    row = _row_plan->build(_fields);
+    if (!_derived.empty()) {
+      derive(row);
+    }
+    if (_join) {
+      join(row);
+    }
+    return true;
+  }
+
+  // Read the next data row without converting its fields, which are decoded
+  // on access. Returns an empty row at the end of the source.
+  ReplayLazyRow advance_lazy() {
+    ReplayLazyRow row;
+    next_lazy(row);
+    return row;
+  }
+
+  // As next_row(), for a lazy row. The row's buffers are reused, so passing
+  // the same object on every call avoids allocations.
+  bool next_lazy(ReplayLazyRow &row) {
+    row._cache.clear();
+    std::string_view line;
+    while (next_line(line)) {
+      {
+        ReplayTraceSpan span("tokenize");
+        _source->with_tokenizer([line, &row](auto tokenizer) {
+          tokenizer.locate_fields(line, row._spans);
+        });
+      }
+      if (!accept(line, row._spans.size())) {
+        continue;
+      }
+      row._source = _source;
+      if (row._plan != _row_plan) {
+        row._plan = _row_plan;
+      }
+      row._line = line;
+      return true;
+    }
+    _status = ReplayRowStatus::ok;
+    row._source.reset();
+    row._plan.reset();
+    row._line = {};
+    row._spans.clear();
+    return false;
+  }
+
+  // Status of the row last returned by advance() or next_row()
+  ReplayRowStatus last_status() const { return _status; }
+
+  // Raw text of the row last read
+  std::string_view last_line() const { return _last_line; }
+
+  // Select how malformed rows are handled; quarantine requires a side file
+  void set_error_policy(ReplayErrorPolicy policy,
+                        std::shared_ptr<ReplayQuarantine> quarantine = nullptr) {
+    if (policy == ReplayErrorPolicy::quarantine && !quarantine) {
+      throw std::invalid_argument("Quarantine policy requires a side file");
+    }
+    _policy = policy;
+    _quarantine = std::move(quarantine);
+  }
+
+  ReplayErrorPolicy error_policy() const { return _policy; }
+
+  // Add a column computed by an expression over the others (see
+  // ReplayExpression), inserted at keypath into the rows returned by
+  // advance() and next_row(). Results that are not finite become null. The
+  // expression is checked against the current schema segment; in segments
+  // lacking a column it reads, the derived column is left out.
+  void add_derived(const std::string &keypath, const std::string &expression) {
+    if (_derived.empty()) {
+      _derived_shape = _row_plan->skeleton;
+    }
+    nlohmann::json::json_pointer pointer;
+    try {
+      pointer = nlohmann::json::json_pointer(
+          ReplayCsv::normalize_keypath(keypath));
+    } catch (const std::exception &) {
+      throw std::invalid_argument("Bad derived column keypath: " + keypath);
+    }
+    if (!fits(_derived_shape, pointer)) {
+      throw std::invalid_argument("Derived column clashes with a column: " +
+                                  keypath);
+    }
+    ReplayExpression compiled(expression, *_row_plan);
+    _derived_shape[pointer] = 0;
+    _derived.push_back(Derived{std::move(pointer), expression, std::nullopt});
+    _derived.back().compiled.emplace(std::move(compiled));
+    derived_columns();
+  }
+
+  void clear_derived() {
+    _derived.clear();
+    _derived_columns.clear();
+  }
+
+  // Verify block checksums while reading (see ReplayIntegrity); a corrupt
+  // block makes reads throw ReplayChecksumError. nullptr disables checks.
+  void set_integrity(std::shared_ptr<ReplayIntegrity> integrity) {
+    if (integrity && &integrity->source() != _source.get()) {
+      throw std::invalid_argument("Integrity check of another source");
+    }
+    _integrity = std::move(integrity);
+    _checked_end = _row == 0 ? 0 : _pos; // from the header when at the start
+  }
+
+  const std::shared_ptr<ReplayIntegrity> &integrity() const {
+    return _integrity;
+  }
+
+  // Enrich the rows returned by advance() and next_row() with the columns
+  // of a lookup table, matched on the given key column. nullptr detaches
+  // the table.
+  void set_join(std::shared_ptr<const ReplayJoin> join,
+                const std::string &keypath = "") {
+    size_t column = ReplayPlan::npos;
+    if (join) {
+      column = _row_plan->column_index(keypath);
+      if (column == ReplayPlan::npos) {
+        throw std::invalid_argument("Unknown join column: " + keypath);
+      }
+    }
+    _join = std::move(join);
+    _join_column = column;
+    _join_keypath = keypath;
+  }
+
+  ReplayStatistics statistics() const {
+    ReplayStatistics stats = _stats;
+    stats.bad_columns = _source->plan().invalid_count;
+    return stats;
+  }
+
+  // 1-based line number of the row last read, counted on demand
+  size_t line_number() {
+    size_t offset = static_cast<size_t>(_last_line.data() - _source->data());
+    if (offset < _line_offset) {
+      _line_offset = 0;
+      _line = 1;
+    }
+    const char *p = _source->data() + _line_offset;
+    const char *end = _source->data() + offset;
+    while (p < end &&
+           (p = static_cast<const char *>(std::memchr(p, '\n', end - p)))) {
+      ++_line;
+      ++p;
+    }
+    _line_offset = offset;
+    return _line;
+  }
+
+  // Tokenize a raw data line and build its JSON object
+  nlohmann::json build(std::string_view line) {
+    _source->with_tokenizer(
+        [this, line](auto tokenizer) { tokenizer.split_line(line, _fields); });
+    return _row_plan->build(_fields);
+  }
+
+  // Return the raw text of the next data row, without parsing it
+  bool next_line(std::string_view &line) {
+    do {
+      if (!(_order ? next_ordered_line(line) : next_file_line(line))) {
+        return false;
+      }
+    } while (_shard_by == ReplayShardBy::key && !in_key_shard(line));
+    return true;
+  }
+
+  bool has_next() const {
+    return _order ? _row < _order->size() : _pos < _end;
+  }
+
+  // Restrict the cursor to shard worker of workers, so that independent
+  // processes opening the same file replay disjoint parts of it that
+  // together cover every row, without coordination:
+  //   rows   equal row ranges (builds the row index)
+  //   bytes  equal byte ranges, cut at line starts: found in O(1) from the
+  //          file size. Rows never span lines (quoted fields cannot hold
+  //          newlines), so any line start is a row boundary.
+  //   key    rows whose key column hashes (FNV-1a of its text) to worker;
+  //          every worker scans the whole file, but a key's rows always go
+  //          to the same worker
+  // Row numbers in tell() and seek() count from the start of the shard
+  // (for key shards, of the file). Range shards after the first start with
+  // the plan of the schema segment they begin in, which builds the row
+  // index for byte shards too.
+  void shard(size_t worker, size_t workers,
+             ReplayShardBy by = ReplayShardBy::bytes,
+             const std::string &key = "") {
+    if (workers == 0 || worker >= workers) {
+      throw std::invalid_argument("Bad shard " + std::to_string(worker) +
+                                  " of " + std::to_string(workers));
+    }
+    size_t begin = _source->data_begin();
+    size_t end = _source->size();
+    size_t first_row = 0;
+    if (by == ReplayShardBy::rows) {
+      const auto &index = _source->row_index();
+      const size_t n = index.size();
+      first_row = n * worker / workers;
+      const size_t last_row = n * (worker + 1) / workers;
+      begin = first_row < n ? index[first_row] : end;
+      end = last_row < n ? index[last_row] : end;
+    } else if (by == ReplayShardBy::bytes) {
+      const size_t span = end - begin;
+      const size_t from = begin + span / workers * worker +
+                          span % workers * worker / workers;
+      const size_t to = begin + span / workers * (worker + 1) +
+                        span % workers * (worker + 1) / workers;
+      begin = line_start(from);
+      end = worker + 1 == workers ? end : line_start(to);
+    } else if (_row_plan->column_index(key) == ReplayPlan::npos) {
+      throw std::invalid_argument("Unknown shard key: " + key);
+    }
+    _shard_by = by;
+    _shard_worker = worker;
+    _shard_workers = workers;
+    _shard_key = key;
+    _shard_column = by == ReplayShardBy::key ? _row_plan->column_index(key)
+                                             : ReplayPlan::npos;
+    _begin = begin;
+    _end = end;
+    _first_row = by == ReplayShardBy::bytes ? ReplayPlan::npos : first_row;
+    _begin_plan = nullptr;
+    if (begin < end && begin > _source->data_begin()) {
+      _begin_plan = by == ReplayShardBy::rows
+                        ? _source->segment_of(first_row).plan
+                        : by == ReplayShardBy::bytes
+                              ? _source->segment_at(begin).plan
+                              : nullptr;
+    }
+    reset();
+  }
+
+  // Data rows of a full pass: the order, or the shard, or the file (uses
+  // the row index; key shards are counted by hashing every key)
+  size_t count_rows() {
+    if (_order) {
+      return _order->size();
+    }
+    const auto &index = _source->row_index();
+    if (_shard_by != ReplayShardBy::key) {
+      return static_cast<size_t>(
+          std::lower_bound(index.begin(), index.end(), _end) -
+          std::lower_bound(index.begin(), index.end(), _begin));
+    }
+    size_t rows = 0;
+    for (size_t row = 0; row < index.size(); ++row) {
+      size_t pos = index[row];
+      std::string_view line =
+          ReplayCsv::next_line(_source->data(), _source->size(), pos);
+      rows += in_key_shard(line, _source->segment_of(row).plan->column_index(
+                                     _shard_key));
+    }
+    return rows;
+  }
+
+  // Read the data rows in the given order (row indices, e.g. a shuffle or
+  // a sample from ReplaySampler) instead of file order. Row numbers in
+  // tell() and seek() then count positions in the order. nullptr restores
+  // file order. Rows are located through the row index, without parsing
+  // the rows skipped.
+  void set_order(std::shared_ptr<const std::vector<size_t>> order) {
+    if (order) {
+      const size_t rows = _source->row_count();
+      for (size_t row : *order) {
+        if (row >= rows) {
+          throw std::out_of_range("Row " + std::to_string(row) +
+                                  " out of range in read order");
+        }
+      }
+    }
+    _order = std::move(order);
+    reset();
+  }
+
+  const std::shared_ptr<const std::vector<size_t>> &order() const {
+    return _order;
+  }
+
+  // Move back to the first data row (of the shard)
+  void reset() {
+    _pos = _begin ? _begin : _source->data_begin();
+    _end = std::min(_end, _source->size());
+    _checked_end = _pos == _source->data_begin() ? 0 : _pos;
+    _row = 0;
+    _plan = _begin_plan ? _begin_plan : _source->shared_plan();
+    skip_ignorable();
+  }
+
+  // Move to the given data row (0-based); seeking past the end leaves the
+  // cursor exhausted
+  void seek(size_t row) {
+    if (_order) {
+      _row = std::min(row, _order->size());
+      return;
+    }
+    const auto &index = _source->row_index();
+    if (_first_row == ReplayPlan::npos) {
+      // Byte shard: rows before it, found on the first seek
+      _first_row = static_cast<size_t>(
+          std::lower_bound(index.begin(), index.end(), _begin) - index.begin());
+    }
+    const size_t file_row = _first_row + row;
+    if (file_row >= index.size() || index[file_row] >= _end) {
+      _pos = _end;
+      _row = count_rows();
+      return;
+    }
+    _pos = index[file_row];
+    _row = row;
+    _checked_end = _pos;
+    _plan = _source->segment_of(file_row).plan;
+  }
+
+  // Index of the row that the next advance() will return
+  size_t tell() const { return _row; }
+
+  // Move to the first row (of the shard) whose value in column is not less
+  // than t. Rows must be sorted on that column; the search parses O(log n)
+  // rows. Not available when reading in a set order.
+  void seek_time(double t, size_t column = 0) {
+    if (_order) {
+      throw std::logic_error("seek_time() is not available with a read order");
+    }
+    const auto &index = _source->row_index();
+    const size_t first = static_cast<size_t>(
+        std::lower_bound(index.begin(), index.end(), _begin) - index.begin());
+    size_t lo = first;
+    size_t hi = static_cast<size_t>(
+        std::lower_bound(index.begin(), index.end(), _end) - index.begin());
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (row_value(mid, column) < t) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    seek(lo - first);
+  }
+
+  // Numeric value of a column in the given row (NaN if not numeric). The
+  // column is an index in the first header; in later schema segments the
+  // column with the same keypath is read.
+  double row_value(size_t row, size_t column) {
+    const ReplayPlan &plan = *_source->segment_of(row).plan;
+    if (&plan != &_source->plan()) {
+      column = column < _source->plan().size()
+                   ? plan.column_index(_source->plan().keypaths[column])
+                   : ReplayPlan::npos;
+    }
+    size_t pos = _source->row_offset(row);
+    std::string_view line =
+        ReplayCsv::next_line(_source->data(), _source->size(), pos);
+    _source->with_tokenizer(
+        [this, line](auto tokenizer) { tokenizer.split_line(line, _fields); });
+    if (column >= _fields.size() || !ReplayCsv::is_numeric(_fields[column])) {
+      return std::numeric_limits<double>::quiet_NaN();
+    }
+    return ReplayCsv::parse_number(_fields[column]);
+  }
+
+  const ReplaySource &source() const { return *_source; }
+
+  // Plan of the row last read: the one of its schema segment
+  const ReplayPlan &plan() const { return *_row_plan; }
+
+  // Plan of the row the next read returns
+  const ReplayPlan &next_plan() const { return *_plan; }
+
+private:
+  std::shared_ptr<const ReplaySource> _source;
+  std::shared_ptr<const ReplayPlan> _plan;     // segment of the row at _pos
+  std::shared_ptr<const ReplayPlan> _row_plan; // segment of the last row
+  size_t _pos = 0;
+  size_t _row = 0;
+  std::vector<std::string> _fields;
+  std::string_view _last_line;
+  ReplayRowStatus _status = ReplayRowStatus::ok;
+  ReplayErrorPolicy _policy = ReplayErrorPolicy::flag;
+  std::shared_ptr<ReplayQuarantine> _quarantine;
+  ReplayStatistics _stats;
+  std::shared_ptr<const ReplayJoin> _join;
+  size_t _join_column = ReplayPlan::npos;
+  std::string _join_keypath;
+  std::shared_ptr<ReplayIntegrity> _integrity;
+  std::shared_ptr<const std::vector<size_t>> _order; // null: file order
+  size_t _begin = 0; // shard byte range, 0 for the start of the data
+  size_t _end = static_cast<size_t>(-1);
+  size_t _first_row = 0; // file row of the shard's first row, npos unknown
+  std::shared_ptr<const ReplayPlan> _begin_plan; // row shards: its segment
+  ReplayShardBy _shard_by = ReplayShardBy::rows;
+  size_t _shard_worker = 0;
+  size_t _shard_workers = 1;
+  std::string _shard_key;
+  size_t _shard_column = ReplayPlan::npos;
+  std::vector<std::string_view> _spans; // key shard scratch
+  std::string _key;
+  size_t _checked_end = 0; // bytes read before this offset are checked
+  struct Derived {
+    nlohmann::json::json_pointer pointer;
+    std::string expression;
+    std::optional<ReplayExpression> compiled; // none: left out in segment
+  };
+  std::vector<Derived> _derived;
+  std::vector<size_t> _derived_columns;  // columns read by any expression
+  std::vector<double> _derived_values;   // their values, by plan column
+  nlohmann::json _derived_shape;         // plan skeleton plus derived leaves
+  size_t _line_offset = 0; // line counting checkpoint
+  size_t _line = 1;
+
+  // next_line() in file order, within the shard
+  bool next_file_line(std::string_view &line) {
+    if (_pos >= _end) {
+      return false;
+    }
+    ReplayTraceSpan span("read");
+    line = ReplayCsv::next_line(_source->data(), _source->size(), _pos);
+    if (_integrity && _pos > _checked_end) {
+      // Everything read since the last check, comments and header included
+      _checked_end = _integrity->check(_checked_end, _pos);
+    }
+    _last_line = line;
+    ++_row;
+    if (_row_plan != _plan) {
+      _row_plan = _plan;
+      replan();
+    }
+    skip_ignorable();
+    return true;
+  }
+
+
+  // next_line() when reading in a given order: _row is the position in it
+  bool next_ordered_line(std::string_view &line) {
+    if (_row >= _order->size()) {
+      return false;
+    }
+    ReplayTraceSpan span("read");
+    const size_t row = (*_order)[_row++];
+    size_t pos = _source->row_offset(row);
+    const size_t begin = pos;
+    line = ReplayCsv::next_line(_source->data(), _source->size(), pos);
+    if (_integrity) {
+      _integrity->check(begin, pos);
+    }
+    _last_line = line;
+    const auto &plan = _source->segment_of(row).plan;
+    if (_row_plan != plan) {
+      _row_plan = plan;
+      replan();
+    }
+    return true;
+  }
+
+  // Check the field count of a row and decide whether to return it
+  bool accept(std::string_view line, size_t fields) {
+    const size_t expected = _row_plan->size();
+    _status = fields == expected ? ReplayRowStatus::ok
+              : fields < expected ? ReplayRowStatus::too_few_fields
+                                  : ReplayRowStatus::too_many_fields;
+    _stats.bytes += line.size();
+    if (_status != ReplayRowStatus::ok && !accept_malformed(line)) {
+      return false;
+    }
+    _stats.rows++;
+    return true;
+  }
+
+  // A new leaf must not replace a column nor descend into one
+  static bool fits(const nlohmann::json &shape,
+                   const nlohmann::json::json_pointer &pointer) {
+    if (pointer.empty() || shape.contains(pointer)) {
+      return false;
+    }
+    for (auto p = pointer.parent_pointer(); !p.empty(); p = p.parent_pointer()) {
+      if (shape.contains(p) && !shape.at(p).is_structured()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void derived_columns() {
+    _derived_columns.clear();
+    for (const auto &d : _derived) {
+      if (!d.compiled) {
+        continue;
+      }
+      for (size_t c : d.compiled->columns()) {
+        if (std::find(_derived_columns.begin(), _derived_columns.end(), c) ==
+            _derived_columns.end()) {
+          _derived_columns.push_back(c);
+        }
+      }
+    }
+    _derived_values.resize(_row_plan->size());
+  }
+
+  // Entering a new schema segment: resolve the derived columns and the
+  // join key against its plan
+  void replan() {
+    if (!_derived.empty()) {
+      _derived_shape = _row_plan->skeleton;
+      for (auto &d : _derived) {
+        d.compiled.reset();
+        if (!fits(_derived_shape, d.pointer)) {
+          continue;
+        }
+        try {
+          d.compiled.emplace(d.expression, *_row_plan);
+          _derived_shape[d.pointer] = 0;
+        } catch (const std::invalid_argument &) {
+        }
+      }
+      derived_columns();
+    }
+    if (_join) {
+      _join_column = _row_plan->column_index(_join_keypath);
+    }
+    if (_shard_by == ReplayShardBy::key) {
+      _shard_column = _row_plan->column_index(_shard_key);
+    }
+  }
+
+  // Start of the first line beginning at or after offset
+  size_t line_start(size_t offset) const {
+    if (offset <= _source->data_begin()) {
+      return _source->data_begin();
+    }
+    if (offset >= _source->size() || _source->data()[offset - 1] == '\n') {
+      return std::min(offset, _source->size());
+    }
+    const void *nl = std::memchr(_source->data() + offset, '\n',
+                                 _source->size() - offset);
+    return nl ? static_cast<size_t>(static_cast<const char *>(nl) -
+                                    _source->data()) +
+                    1
+              : _source->size();
+  }
+
+  bool in_key_shard(std::string_view line) {
+    return in_key_shard(line, _shard_column);
+  }
+
+  // FNV-1a of the key's decoded text, stable across runs and platforms
+  bool in_key_shard(std::string_view line, size_t column) {
+    _source->with_tokenizer([&](auto tokenizer) {
+      tokenizer.locate_fields(line, _spans);
+      _key.clear();
+      if (column < _spans.size()) {
+        tokenizer.decode_field(_spans[column], _key);
+      }
+    });
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : _key) {
+      hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash % _shard_workers == _shard_worker;
+  }
+
+  // Convert the columns the expressions read, once, and insert the results
+  void derive(nlohmann::json &row) {
+    for (size_t c : _derived_columns) {
+      _derived_values[c] = c < _fields.size() && ReplayCsv::is_numeric(_fields[c])
+                               ? ReplayCsv::parse_number(_fields[c])
+                               : std::numeric_limits<double>::quiet_NaN();
+    }
+    for (const auto &d : _derived) {
+      if (!d.compiled) {
+        continue;
+      }
+      const double value = d.compiled->evaluate(_derived_values.data());
+      if (std::isfinite(value)) {
+        row[d.pointer] = value;
+      } else {
+        row[d.pointer] = nullptr;
+      }
+    }
+  }
+
+  // Splice the matching lookup row, if any, into row
+  void join(nlohmann::json &row) {
+    const size_t match = _join_column < _fields.size()
+                             ? _join->find(_fields[_join_column])
+                             : ReplayJoin::npos;
+    if (match == ReplayJoin::npos) {
+      _stats.unmatched++;
+    } else {
+      _join->splice(match, row);
+    }
+  }
+
+  // Count a malformed row and decide whether to return it
+  bool accept_malformed(std::string_view line) {
+    if (_status == ReplayRowStatus::too_few_fields) {
+      _stats.too_few_fields++;
+    } else {
+      _stats.too_many_fields++;
+    }
+    switch (_policy) {
+    case ReplayErrorPolicy::flag:
+      return true;
+    case ReplayErrorPolicy::quarantine:
+      if (_quarantine->write(line_number(), _status, line)) {
+        _stats.quarantined++;
+      }
+      break;
+    case ReplayErrorPolicy::skip:
+      break;
+    }
+    _stats.skipped++;
+    return false;
+  }
+
+  void skip_ignorable() {
+    _source->with_tokenizer([this](auto tokenizer) {
+      while (_pos < _end) {
+        size_t next = _pos;
+        std::string_view line =
+            ReplayCsv::next_line(_source->data(), _source->size(), next);
+        if (_source->is_header_line(line)) {
+          _plan = _source->plan_for(line); // a new schema segment
+        } else if (!tokenizer.is_ignorable_line(line)) {
+          return;
+        }
+        _pos = next;
+      }
+    });
+  }
+};
+
+// Read orders for shuffled playback and sampling, as row indices for
+// ReplayCursor::set_order(). Every order is a pure function of its seed:
+// the generator is std::mt19937_64 and bounded draws use rejection, so the
+// same seed gives the same order on every platform.
+struct ReplaySampler {
+  using Order = std::shared_ptr<const std::vector<size_t>>;
+
+  // All rows in a uniformly random order
+  static Order permutation(size_t rows, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    auto order = std::make_shared<std::vector<size_t>>(rows);
+    for (size_t i = 0; i < rows; ++i) {
+      (*order)[i] = i;
+    }
+    shuffle(order->begin(), order->end(), rng);
+    return order;
+  }
+
+  // All rows, shuffled in two levels that keep reads mostly sequential:
+  // the file is cut into blocks of block_rows consecutive rows, blocks are
+  // taken in random order, and rows are shuffled within groups of
+  // buffer_blocks blocks. Only a group's blocks are read at a time, so a
+  // group is the working set of a training shuffle buffer.
+  static Order block_shuffle(size_t rows, uint64_t seed,
+                             size_t block_rows = 1024,
+                             size_t buffer_blocks = 16) {
+    if (block_rows == 0 || buffer_blocks == 0) {
+      throw std::invalid_argument("Shuffle blocks must not be empty");
+    }
+    std::mt19937_64 rng(seed);
+    std::vector<size_t> blocks((rows + block_rows - 1) / block_rows);
+    for (size_t b = 0; b < blocks.size(); ++b) {
+      blocks[b] = b;
+    }
+    shuffle(blocks.begin(), blocks.end(), rng);
+    auto order = std::make_shared<std::vector<size_t>>();
+    order->reserve(rows);
+    for (size_t g = 0; g < blocks.size(); g += buffer_blocks) {
+      const size_t group_begin = order->size();
+      for (size_t b = g; b < std::min(blocks.size(), g + buffer_blocks); ++b) {
+        const size_t first = blocks[b] * block_rows;
+        for (size_t r = first; r < std::min(rows, first + block_rows); ++r) {
+          order->push_back(r);
+        }
+      }
+      shuffle(order->begin() + group_begin, order->end(), rng);
+    }
+    return order;
+  }
+
+  // k distinct rows chosen uniformly (all rows if k >= rows), in file
+  // order so that they are read front to back. Uses the row index only.
+  static Order sample(size_t rows, size_t k, uint64_t seed) {
+    auto order = std::make_shared<std::vector<size_t>>();
+    if (k >= rows) {
+      order->resize(rows);
+      for (size_t i = 0; i < rows; ++i) {
+        (*order)[i] = i;
+      }
+      return order;
+    }
+    // Floyd's algorithm: k draws, no rejection loop over taken rows
+    std::mt19937_64 rng(seed);
+    std::unordered_set<size_t> taken;
+    taken.reserve(2 * k);
+    for (size_t j = rows - k; j < rows; ++j) {
+      const size_t t = below(rng, j + 1);
+      taken.insert(taken.count(t) ? j : t);
+    }
+    order->assign(taken.begin(), taken.end());
+    std::sort(order->begin(), order->end());
+    return order;
+  }
+
+  // One-pass reservoir sample of k of the rows left in cursor, for when
+  // the row index is not wanted. Rows are tokenized only when they enter
+  // the reservoir's final selection; the result is in file order. Rows
+  // are built with the plan of the row last read by the cursor.
+  static std::vector<nlohmann::json> reservoir(ReplayCursor &cursor, size_t k,
+                                               uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::pair<size_t, std::string_view>> kept; // seen, line
+    kept.reserve(k);
+    std::string_view line;
+    for (size_t seen = 0; k > 0 && cursor.next_line(line); ++seen) {
+      if (kept.size() < k) {
+        kept.emplace_back(seen, line);
+      } else {
+        const size_t j = below(rng, seen + 1);
+        if (j < k) {
+          kept[j] = {seen, line};
+        }
+      }
+    }
+    std::sort(kept.begin(), kept.end());
+    std::vector<nlohmann::json> rows;
+    rows.reserve(kept.size());
+    for (const auto &entry : kept) {
+      rows.push_back(cursor.build(entry.second));
+    }
+    return rows;
+  }
+
+private:
+  // Uniform integer in [0, n)
+  static uint64_t below(std::mt19937_64 &rng, uint64_t n) {
+    const uint64_t threshold = (0 - n) % n; // 2^64 mod n
+    uint64_t x;
+    do {
+      x = rng();
+    } while (x < threshold);
+    return x % n;
+  }
+
+  // Fisher-Yates
+  template <typename It>
+  static void shuffle(It first, It last, std::mt19937_64 &rng) {
+    for (auto n = last - first; n > 1; --n) {
+      std::iter_swap(first + (n - 1),
+                     first + static_cast<std::ptrdiff_t>(
+                                 below(rng, static_cast<uint64_t>(n))));
+    }
+  }
+};
+
+// CPU topology and thread placement. NUMA nodes are read from sysfs on
+// Linux; elsewhere, or when sysfs is not available, all CPUs form node 0.
+struct ReplayCpu {
+  // CPUs of every NUMA node, indexed by node number (empty for nodes
+  // without CPUs)
+  static std::vector<std::vector<int>> numa_nodes() {
+    std::vector<std::vector<int>> nodes;
+#if defined(__linux__)
+    for (int node = 0;; ++node) {
+      std::ifstream list("/sys/devices/system/node/node" +
+                         std::to_string(node) + "/cpulist");
+      if (!list.is_open()) {
+        break;
+      }
+      std::string text;
+      std::getline(list, text);
+      nodes.push_back(parse_cpu_list(text));
+    }
+#endif
+    if (nodes.empty()) {
+      nodes.emplace_back();
+      const int n = static_cast<int>(
+          std::max(1u, std::thread::hardware_concurrency()));
+      for (int cpu = 0; cpu < n; ++cpu) {
+        nodes[0].push_back(cpu);
+      }
+    }
+    return nodes;
+  }
+
+  // Parse a Linux CPU list such as "0-3,8,10-11"
+  static std::vector<int> parse_cpu_list(const std::string &text) {
+    std::vector<int> cpus;
+    std::istringstream in(text);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+      if (range.empty() ||
+          !std::isdigit(static_cast<unsigned char>(range[0]))) {
+        continue;
+      }
+      size_t dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+
+  // Restrict the calling thread to the given CPUs. Returns false if this is
+  // not supported or not permitted.
+  static bool pin_current_thread(const std::vector<int> &cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) {
+      return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+  }
+};
+
+// Real-time options for the thread running a paced play(). Each option is
+// best effort: what was actually granted is reported in ReplayRealtimeStatus.
+struct ReplayRealtime {
+  int priority = 0;         // SCHED_FIFO priority (1-99), 0 = keep scheduler
+  std::vector<int> cpus;    // CPU affinity, empty = keep affinity
+  bool lock_memory = false; // mlockall(), so that pages are never swapped out
+  size_t lookahead = 0;     // rows parsed ahead while waiting for a deadline
+};
+
+struct ReplayRealtimeStatus {
+  bool fifo = false;          // running under SCHED_FIFO
+  bool pinned = false;        // affinity set to the requested CPUs
+  bool memory_locked = false; // mlockall() succeeded
+};
+
+// Applies ReplayRealtime to the calling thread for the lifetime of the
+// object; scheduler and affinity are restored on destruction. Locked memory
+// stays locked, as mlockall() is process wide.
+class ReplayRealtimeScope {
+public:
+  explicit ReplayRealtimeScope(const ReplayRealtime &options) {
+#if defined(__linux__)
+    if (options.priority > 0) {
+      _restore_sched =
+          ::pthread_getschedparam(::pthread_self(), &_policy, &_param) == 0;
+      sched_param param{};
+      param.sched_priority = options.priority;
+      _status.fifo = ::pthread_setschedparam(::pthread_self(), SCHED_FIFO,
+                                             &param) == 0;
+    }
+    if (!options.cpus.empty()) {
+      _restore_affinity = ::pthread_getaffinity_np(
+                              ::pthread_self(), sizeof(_affinity),
+                              &_affinity) == 0;
+      _status.pinned = ReplayCpu::pin_current_thread(options.cpus);
+    }
+    if (options.lock_memory) {
+      // Lock pages as they are touched rather than the whole mapped file
+#if defined(MCL_ONFAULT)
+      _status.memory_locked =
+          ::mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0;
+#else
+      _status.memory_locked = ::mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#endif
+    }
+#else
+    (void)options;
+#endif
+  }
+
+  ~ReplayRealtimeScope() {
+#if defined(__linux__)
+    if (_status.fifo && _restore_sched) {
+      ::pthread_setschedparam(::pthread_self(), _policy, &_param);
+    }
+    if (_status.pinned && _restore_affinity) {
+      ::pthread_setaffinity_np(::pthread_self(), sizeof(_affinity),
+                               &_affinity);
+    }
+#endif
+  }
+
+  ReplayRealtimeScope(const ReplayRealtimeScope &) = delete;
+  ReplayRealtimeScope &operator=(const ReplayRealtimeScope &) = delete;
+
+  const ReplayRealtimeStatus &status() const { return _status; }
+
+private:
+  ReplayRealtimeStatus _status;
+#if defined(__linux__)
+  bool _restore_sched = false;
+  bool _restore_affinity = false;
+  int _policy = SCHED_OTHER;
+  sched_param _param{};
+  cpu_set_t _affinity;
+#endif
+};
+
+// What a producer does when the memory budget is exhausted: wait for the
+// consumer to free memory, or drop the data it was about to buffer
+enum class ReplayOverflow { block, shed };
+
+// Byte budget covering the buffers, queues and caches of one Replay.
+// Producers acquire() before buffering and release() once the data is
+// consumed; a limit of 0 means unlimited.
+class ReplayMemoryBudget {
 public:
-  // Constructor takes the path to the CSV file
-  explicit Replay(const std::string &csv__filepath)
-      : _file(csv__filepath), __headersparsed(false) {
-    if (!_file.is_open()) {
-      throw std::runtime_error("Failed to open CSV file: " + csv__filepath);
+  explicit ReplayMemoryBudget(size_t limit = 0,
+                              ReplayOverflow policy = ReplayOverflow::block)
+      : _limit(limit), _policy(policy) {}
+
+  void set_limit(size_t limit, ReplayOverflow policy = ReplayOverflow::block) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _limit = limit;
+    _policy = policy;
+    _cv.notify_all();
+  }
+
+  // Reserve bytes. Returns false if the budget is exhausted and the policy
+  // is shed, or if cancel becomes true while blocked. A request larger than
+  // the whole limit is granted when nothing else is held, so it can never
+  // wait forever.
+  bool acquire(size_t bytes, const std::atomic<bool> *cancel = nullptr) {
+    return reserve(bytes, cancel, _policy == ReplayOverflow::shed);
+  }
+
+  // Like acquire(), but always waits for room: for data that cannot be
+  // dropped, such as chunks of an ordered conversion
+  bool acquire_wait(size_t bytes, const std::atomic<bool> *cancel = nullptr) {
+    return reserve(bytes, cancel, false);
+  }
+
+  // Account for memory that must be held regardless of the limit (caches)
+  void charge(size_t bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    add(bytes);
+  }
+
+  void release(size_t bytes) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _used.fetch_sub(std::min(bytes, _used.load(std::memory_order_relaxed)),
+                    std::memory_order_relaxed);
+    _cv.notify_all();
+  }
+
+  // Wake blocked producers, e.g. after setting their cancel flag
+  void wake() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cv.notify_all();
+  }
+
+  size_t used() const { return _used.load(std::memory_order_relaxed); }
+  size_t peak() const { return _peak.load(std::memory_order_relaxed); }
+  size_t shed() const { return _shed.load(std::memory_order_relaxed); }
+  size_t limit() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _limit;
+  }
+  ReplayOverflow policy() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _policy;
+  }
+
+private:
+  mutable std::mutex _mutex;
+  std::condition_variable _cv;
+  size_t _limit;
+  ReplayOverflow _policy;
+  std::atomic<size_t> _used{0};
+  std::atomic<size_t> _peak{0};
+  std::atomic<size_t> _shed{0};
+
+  bool reserve(size_t bytes, const std::atomic<bool> *cancel, bool shed) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto fits = [this, bytes]() {
+      size_t used = _used.load(std::memory_order_relaxed);
+      return _limit == 0 || used + bytes <= _limit || used == 0;
+    };
+    if (!fits()) {
+      if (shed && _policy == ReplayOverflow::shed) {
+        _shed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      _cv.wait(lock, [&]() { return fits() || (cancel && *cancel); });
+      if (!fits()) {
+        return false;
+      }
     }
-    parse_headers();
+    add(bytes);
+    return true;
   }
 
-  // Destructor to ensure file is closed
-  ~Replay() {
-    if (_file.is_open()) {
-      _file.close();
+  void add(size_t bytes) {
+    size_t used = _used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (used > _peak.load(std::memory_order_relaxed)) {
+      _peak.store(used, std::memory_order_relaxed);
     }
   }
+};
 
-  // Read the next line and return as JSON object
-  // Returns empty JSON object if end of file is reached
-  // Skips comment lines (lines starting with '#' with optional leading spaces)
-  nlohmann::json advance() {
-    std::string line;
-    while (std::getline(_file, line)) {
-      // Skip comment lines and empty lines
-      if (is_comment_line(line) || is_empty_line(line)) {
-        continue;
-      }
+// Live counters of a Replay, readable from any thread (e.g. by
+// ReplayMetricsExporter). The thread reading rows publishes them in
+// batches, so the row loop does not write shared cache lines on every row.
+struct ReplayMetrics {
+  // Rows between two publications
+  static constexpr size_t publish_interval = 64;
+
+  std::atomic<uint64_t> rows{0};        // data rows read
+  std::atomic<uint64_t> bytes{0};       // bytes of data rows read
+  std::atomic<uint64_t> errors{0};      // malformed rows
+  std::atomic<uint64_t> skipped{0};     // malformed rows not returned
+  std::atomic<uint64_t> queue_depth{0}; // rows waiting in the prefetch queue
+  std::atomic<uint64_t> memory{0};      // bytes charged to the memory budget
+  std::atomic<int64_t> lag_ns{0};       // lateness of the last paced row
+  const std::chrono::steady_clock::time_point started =
+      std::chrono::steady_clock::now();
+
+  void publish(const ReplayStatistics &stats, size_t memory_used) {
+    rows.store(stats.rows, std::memory_order_relaxed);
+    bytes.store(stats.bytes, std::memory_order_relaxed);
+    errors.store(stats.errors(), std::memory_order_relaxed);
+    skipped.store(stats.skipped, std::memory_order_relaxed);
+    memory.store(memory_used, std::memory_order_relaxed);
+  }
+};
+
+// Bounded reorder buffer: rows go into a min-heap on their timestamp and
+// come out in timestamp order once the watermark (newest timestamp seen
+// minus the lateness window) has passed them. Rows older than the
+// watermark on arrival are late: they are counted and dropped, as emitting
+// them would break the order.
+class ReplayReorder {
+public:
+  explicit ReplayReorder(double window = 0.0) : _window(window) {}
+
+  double window() const { return _window; }
 
-      auto row = parse_csv_line(line);
-      return build_json_from_row(row);
+  // Timestamps not greater than the watermark are final
+  double watermark() const { return _newest - _window; }
+
+  // Add a row; returns false if it was late and dropped. A row without a
+  // finite timestamp (pass NaN if missing) keeps its place after the newest.
+  bool push(nlohmann::json row, double t) {
+    if (!std::isfinite(t)) {
+      t = _newest;
+    }
+    if (_started && t < watermark()) {
+      _late++;
+      return false;
+    }
+    if (!_started || t > _newest) {
+      _newest = t;
+      _started = true;
     }
+    _heap.push_back(Entry{t, _seq++, std::move(row)});
+    std::push_heap(_heap.begin(), _heap.end(), later);
+    return true;
+  }
 
-    // If we reach EOF and loop mode is enabled, reset and try again
-    if (_loop_enabled && _file.eof()) {
-      reset();
-      // Try to read the first data line after reset
-      while (std::getline(_file, line)) {
-        // Skip comment lines and empty lines
-        if (is_comment_line(line) || is_empty_line(line)) {
-          continue;
-        }
+  // Take the oldest row if the watermark has passed it
+  bool pop(nlohmann::json &row) {
+    if (_heap.empty() || _heap.front().t > watermark()) {
+      return false;
+    }
+    return drain(row);
+  }
 
-        auto row = parse_csv_line(line);
-        return build_json_from_row(row);
-      }
+  // Take the oldest row regardless of the watermark (end of input)
+  bool drain(nlohmann::json &row) {
+    if (_heap.empty()) {
+      return false;
     }
+    std::pop_heap(_heap.begin(), _heap.end(), later);
+    row = std::move(_heap.back().row);
+    _heap.pop_back();
+    return true;
+  }
+
+  // Drop buffered rows and start a new sequence of timestamps
+  void clear() {
+    _heap.clear();
+    _started = false;
+  }
+
+  bool empty() const { return _heap.empty(); }
+  size_t size() const { return _heap.size(); }
+  size_t late() const { return _late; }
+
+private:
+  struct Entry {
+    double t;
+    uint64_t seq; // arrival order, to keep equal timestamps stable
+    nlohmann::json row;
+  };
+
+  static bool later(const Entry &a, const Entry &b) {
+    return a.t > b.t || (a.t == b.t && a.seq > b.seq);
+  }
+
+  double _window;
+  std::vector<Entry> _heap;
+  double _newest = 0.0;
+  bool _started = false;
+  uint64_t _seq = 0;
+  size_t _late = 0;
+};
+
+class Replay {
+public:
+  using Source = ReplaySource;
+  using Cursor = ReplayCursor;
+
+  // Constructor takes the path to the CSV file
+  // The CSV dialect is sniffed from the file unless given explicitly
+  explicit Replay(const std::string &csv__filepath,
+                  ReplayDialect dialect = ReplayDialect::automatic,
+                  ReplayHugePages pages = ReplayHugePages::none)
+      : Replay(ReplaySource::open(csv__filepath, dialect, pages)) {}
+
+  // Constructor sharing an already opened source with other Replay or
+  // ReplayCursor instances
+  explicit Replay(std::shared_ptr<const ReplaySource> source)
+      : _source(std::move(source)), _cursor(_source),
+        _budget(std::make_shared<ReplayMemoryBudget>()) {}
+
+  Replay(const Replay &) = delete;
+  Replay &operator=(const Replay &) = delete;
 
+  ~Replay() { stop_prefetch(); }
+
+  // Read the next line and return as JSON object
+  // Returns empty JSON object if end of file is reached
+  // Skips comment lines (lines starting with '#' with optional leading spaces)
+  nlohmann::json advance() {
+    nlohmann::json row;
+    if (_reorder.window() > 0.0) {
+      reordered_row(row);
+      return row;
+    }
+    size_t cursor_row;
+    const ReplayPlan *plan;
+    if (next_row(row, cursor_row, plan)) {
+      return row;
+    }
     // Return empty JSON object if no more lines (or loop is disabled)
     return nlohmann::json{};
   }
 
+  // Read the next data row as a lazy row, whose fields are converted only
+  // when accessed. Lazy rows bypass the prefetch queue: rows already queued
+  // are given back to the cursor first. Returns an empty row at the end.
+  ReplayLazyRow advance_lazy() {
+    stop_prefetch();
+    ReplayLazyRow row;
+    if (!_cursor.next_lazy(row) && _loop_enabled) {
+      reset();
+      _cursor.next_lazy(row);
+    }
+    publish_metrics(row.empty());
+    return row;
+  }
+
   // Check if there are more lines to read
   // In loop mode, this always returns true (infinite loop)
   bool has_next() const {
     if (_loop_enabled) {
       return true; // Always has next in loop mode
     }
-    return _file.good() && !_file.eof();
+    if (!_ahead.empty() || !_reorder.empty() || _reorder_held) {
+      return true;
+    }
+    if (_prefetch) {
+      std::unique_lock<std::mutex> lock(_prefetch->mutex);
+      _prefetch->cv.wait(lock, [this]() {
+        return !_prefetch->queue.empty() || _prefetch->done;
+      });
+      // A pending error is raised by the next advance()
+      return !_prefetch->queue.empty() || _prefetch->error;
+    }
+    return _cursor.has_next();
   }
 
   // Reset to beginning of file (after header)
   void reset() {
-    _file.clear();
-    _file.seekg(0);
-    // Skip comment lines and header line
-    std::string line;
-    while (std::getline(_file, line)) {
-      if (is_comment_line(line) || is_empty_line(line)) {
-        continue; // Skip comment lines and empty lines
-      }
-      // This is the header line, we've found it and can stop
-      break;
-    }
+    stop_prefetch();
+    _cursor.reset();
+    _pace_started = false;
+    clear_reorder();
   }
 
   // Process all remaining lines by calling the provided lambda with each JSON
@@ -107,6 +3320,8 @@ public:
   //   }); replay.play([](const auto& json) { process(json); }, 3);  // max 3
   //   cycles
   template <typename Func> void play(Func &&func, size_t max_cycles = 0) {
+    ReplayRealtimeScope realtime(_realtime);
+    _realtime_status = realtime.status();
     if (!_loop_enabled || max_cycles == 0) {
       // Normal mode: process until end of file or unlimited cycles in loop mode
       while (has_next()) {
@@ -114,6 +3329,8 @@ public:
         if (json_obj.empty()) {
           break;
         }
+        pace(json_obj);
+        ReplayTraceSpan span("callback");
         func(json_obj);
       }
     } else {
@@ -134,7 +3351,11 @@ public:
           break; // Shouldn't happen in loop mode, but safety check
         }
 
-        func(json_obj);
+        pace(json_obj);
+        {
+          ReplayTraceSpan span("callback");
+          func(json_obj);
+        }
         rows_processed++;
       }
     }
@@ -142,161 +3363,633 @@ public:
 
   // Set loop mode - if true, advance() will reset to beginning when EOF is
   // reached
-  void set_loop(bool enabled) { _loop_enabled = enabled; }
+  void set_loop(bool enabled) {
+    stop_prefetch();
+    _loop_enabled = enabled;
+  }
 
   // Get current loop mode
   bool is_loop_enabled() const { return _loop_enabled; }
 
-private:
-  std::ifstream _file;
-  std::vector<nlohmann::json::json_pointer> _headers;
-  bool __headersparsed;
-  bool _loop_enabled = false; // Loop mode flag
-
-  // Helper methods
+  // Select the column holding timestamps in seconds (first column by
+  // default), used by seek_time() and by paced play()
+  void set_time_column(const std::string &keypath) {
+    size_t column = _source->plan().column_index(keypath);
+    if (column == ReplayPlan::npos) {
+      throw std::invalid_argument("Unknown time column: " + keypath);
+    }
+    _time_column = column;
+  }
 
-  // Count the number of data rows in the file (excluding header and comments)
-  size_t count_data_rows() {
-    // Save current position
-    auto current_pos = _file.tellg();
+  size_t time_column() const { return _time_column; }
 
-    // Reset to beginning to count rows
-    reset();
+  // Move to the first row with a timestamp not earlier than t
+  void seek_time(double t) {
+    stop_prefetch();
+    charge_index();
+    _cursor.seek_time(t, _time_column);
+    _pace_started = false;
+    clear_reorder();
+  }
 
-    size_t count = 0;
-    std::string line;
-    while (std::getline(_file, line)) {
-      // Skip comment lines and empty lines
-      if (is_comment_line(line) || is_empty_line(line)) {
-        continue;
-      }
-      count++;
+  // Copy the rows with t0 <= time < t1 to a new CSV file, after the header
+  // of the segment they start in. The byte range is found by binary search
+  // on the time column (rows must be sorted), which tokenizes only the
+  // O(log n) rows it probes, and copied as is, in the kernel where possible
+  // (copy_file_range, then sendfile). Comments between the rows are kept.
+  // Returns the number of rows copied.
+  size_t extract(double t0, double t1, const std::string &out_path) const {
+    if (!(t0 <= t1)) {
+      throw std::invalid_argument("Extract range ends before it starts");
     }
+    ReplayCursor cursor(_source);
+    cursor.seek_time(t0, _time_column);
+    const size_t first = cursor.tell();
+    cursor.seek_time(t1, _time_column);
+    const size_t last = cursor.tell();
+    const size_t rows = _source->row_count();
+    const size_t begin =
+        first < rows ? _source->row_offset(first) : _source->size();
+    const size_t end = last < rows ? _source->row_offset(last) : _source->size();
+    size_t pos = first < rows ? _source->segment_of(first).offset
+                              : _source->segments().front().offset;
+    std::string header(
+        ReplayCsv::next_line(_source->data(), _source->size(), pos));
+    header += '\n';
+    copy_range(*_source, header, begin, end, out_path);
+    return last - first;
+  }
+
+  // Set the pacing speed of play(): 1.0 replays in real time following the
+  // time column, 2.0 twice as fast and so on; 0 (default) disables pacing
+  void set_speed(double speed) {
+    _speed = speed;
+    _pace_started = false;
+  }
 
-    // Restore file position
-    _file.clear();
-    _file.seekg(current_pos);
+  double speed() const { return _speed; }
 
-    return count;
+  // Emit rows in time column order, tolerating rows up to window seconds
+  // out of order; rows later than that are dropped and counted in
+  // statistics().late. 0 (default) disables reordering.
+  void set_reorder(double window) {
+    if (window < 0.0) {
+      throw std::invalid_argument("Reorder window must not be negative");
+    }
+    clear_reorder();
+    _reorder = ReplayReorder(window);
   }
 
-  void parse_headers() {
-    std::string header_line;
-    while (std::getline(_file, header_line)) {
-      // Skip comment lines and empty lines to find the actual header
-      if (is_comment_line(header_line) || is_empty_line(header_line)) {
-        continue;
-      }
-      std::vector<std::string> keypaths = parse_csv_line(header_line);
-      for (auto &kp : keypaths) {
-        _headers.emplace_back(pointer_from_string(kp));
-      }
-      __headersparsed = true;
-      return;
+  double reorder_window() const { return _reorder.window(); }
+
+  // Rows up to this timestamp have been emitted in order by the reorder
+  // buffer
+  double watermark() const { return _reorder.watermark(); }
+
+  // Real-time options applied to the thread calling play(), for the
+  // duration of the call. With a lookahead, rows are parsed ahead while
+  // waiting for a paced deadline, so at the deadline the row is ready.
+  void set_realtime(const ReplayRealtime &options) {
+    if (options.priority < 0 || options.priority > 99) {
+      throw std::invalid_argument("SCHED_FIFO priority must be in 0-99");
     }
+    stop_prefetch();
+    _realtime = options;
+  }
+
+  const ReplayRealtime &realtime() const { return _realtime; }
 
-    throw std::runtime_error("CSV file is empty or cannot read header line");
+  // What the last play() actually obtained of the real-time options
+  ReplayRealtimeStatus realtime_status() const { return _realtime_status; }
+
+  // Parse up to rows rows ahead of the consumer on a background thread (0,
+  // the default, disables prefetching). Queued rows count against the
+  // memory budget.
+  void set_prefetch(size_t rows) {
+    stop_prefetch();
+    _prefetch_rows = rows;
   }
 
-  std::vector<std::string> parse_csv_line(const std::string &line) {
-    std::vector<std::string> result;
-    std::stringstream ss;
-    bool in_quotes = false;
+  size_t prefetch() const { return _prefetch_rows; }
 
-    for (size_t i = 0; i < line.length(); ++i) {
-      char c = line[i];
+  // Limit the memory held by this Replay; 0 means unlimited. The budget
+  // covers the rows in the prefetch queue (estimated from line length and
+  // column count) and the row index once built; the mapped file and the
+  // rows handed to the caller are not counted. When the limit is hit the
+  // prefetch thread blocks until rows are consumed, or drops rows if the
+  // policy is shed. Shed rows are not parsed and appear only in shed_rows().
+  void set_memory_budget(size_t bytes,
+                         ReplayOverflow policy = ReplayOverflow::block) {
+    _budget->set_limit(bytes, policy);
+  }
 
-      if (c == '"') {
-        in_quotes = !in_quotes;
-      } else if (c == ',' && !in_quotes) {
-        result.push_back(ss.str());
-        ss.str("");
-        ss.clear();
-      } else {
-        ss << c;
-      }
+  // Bytes currently accounted against the budget
+  size_t memory_usage() const { return _budget->used(); }
+
+  // Rows dropped because the budget was exhausted under the shed policy
+  size_t shed_rows() const { return _budget->shed(); }
+
+  ReplayMemoryBudget &memory_budget() { return *_budget; }
+
+  // Select how rows with too few or too many fields are handled. With
+  // ReplayErrorPolicy::quarantine they are appended to quarantine_path along
+  // with their line number.
+  void set_error_policy(ReplayErrorPolicy policy,
+                        const std::string &quarantine_path = "") {
+    stop_prefetch();
+    std::shared_ptr<ReplayQuarantine> quarantine;
+    if (policy == ReplayErrorPolicy::quarantine) {
+      quarantine = std::make_shared<ReplayQuarantine>(quarantine_path);
     }
+    _cursor.set_error_policy(policy, std::move(quarantine));
+  }
 
-    // Add the last field
-    result.push_back(ss.str());
+  // Replay only shard worker of workers of the file, e.g. in one of several
+  // worker processes (see ReplayCursor::shard)
+  void shard(size_t worker, size_t workers,
+             ReplayShardBy by = ReplayShardBy::bytes,
+             const std::string &key = "") {
+    stop_prefetch();
+    _cursor.shard(worker, workers, by, key);
+    reset();
+  }
 
-    return result;
+  // Play the rows in the given order, e.g. a shuffle or a sample from
+  // ReplaySampler (see ReplayCursor::set_order). In loop mode every cycle
+  // follows the same order. Restarts from the first row of the order.
+  void set_order(std::shared_ptr<const std::vector<size_t>> order) {
+    stop_prefetch();
+    _cursor.set_order(std::move(order));
+    reset();
   }
 
-  std::string normalize_keypath(const std::string &input) {
-    std::string output;
-    if (input[0] == '/') { // already a json_pointer string
-      return input;
+  // Verify per-block checksums while reading, against a sidecar file
+  // written by an earlier replay (see ReplayIntegrity)
+  void set_integrity(std::shared_ptr<ReplayIntegrity> integrity) {
+    stop_prefetch();
+    _cursor.set_integrity(std::move(integrity));
+  }
+
+  // Add a column computed from the others, e.g.
+  //   replay.add_derived("speed_ms", "speed / 3.6");
+  void add_derived(const std::string &keypath, const std::string &expression) {
+    stop_prefetch();
+    _cursor.add_derived(keypath, expression);
+  }
+
+  void clear_derived() {
+    stop_prefetch();
+    _cursor.clear_derived();
+  }
+
+  // Enrich every row with the columns of a lookup CSV, matched on a key
+  // column of this file (see ReplayJoin)
+  void set_join(std::shared_ptr<const ReplayJoin> join,
+                const std::string &keypath = "") {
+    stop_prefetch();
+    _cursor.set_join(std::move(join), keypath);
+  }
+
+  // Status of the row last returned by advance() (not meaningful while
+  // prefetching, as the cursor runs ahead)
+  ReplayRowStatus last_status() const { return _cursor.last_status(); }
+
+  // Row, byte and error counters. While prefetching, they count the rows
+  // read ahead, from a snapshot the prefetch thread keeps.
+  ReplayStatistics statistics() const {
+    ReplayStatistics stats;
+    if (_prefetch) {
+      std::lock_guard<std::mutex> lock(_prefetch->mutex);
+      stats = _prefetch->stats;
+    } else {
+      stats = _cursor.statistics();
     }
-    output.reserve(input.size());
+    stats.late = _reorder.late();
+    return stats;
+  }
 
-    for (size_t i = 0; i < input.size(); ++i) {
-      char c = input[i];
+  // Live counters, e.g. for ReplayMetricsExporter. They are published every
+  // ReplayMetrics::publish_interval rows and at the end of the file.
+  std::shared_ptr<const ReplayMetrics> metrics() const { return _metrics; }
 
-      if (c == ']') {
-        // If ']' is followed by '.', replace the pair "]." with '/'
-        if (i + 1 < input.size() && input[i + 1] == '.') {
-          output.push_back('/');
-          ++i; // skip the dot as well
+  // Shared source, e.g. for creating additional cursors over the same file
+  std::shared_ptr<const ReplaySource> source() const { return _source; }
+
+  ReplayCursor &cursor() { return _cursor; }
+
+private:
+  std::shared_ptr<const ReplaySource> _source;
+  ReplayCursor _cursor;
+  bool _loop_enabled = false; // Loop mode flag
+  size_t _time_column = 0;
+  double _speed = 0.0;
+  bool _pace_started = false;
+  double _pace_t0 = 0.0;
+  std::chrono::steady_clock::time_point _pace_wall0;
+  std::shared_ptr<ReplayMemoryBudget> _budget;
+  bool _index_charged = false;
+  std::shared_ptr<ReplayMetrics> _metrics = std::make_shared<ReplayMetrics>();
+  ReplayRealtime _realtime;
+  ReplayRealtimeStatus _realtime_status;
+
+  // Row parsed ahead by a paced play() while waiting for a deadline
+  struct Ahead {
+    nlohmann::json row;
+    size_t cursor_row;
+    const ReplayPlan *plan; // of the row's schema segment
+  };
+  std::deque<Ahead> _ahead;
+
+  ReplayReorder _reorder;
+  std::unique_ptr<Ahead> _reorder_held; // first row of a new loop
+  size_t _reorder_row = 0; // cursor row of the last row into the buffer
+  size_t _unpublished = 0; // rows read since metrics were last published
+
+  // Row parsed ahead by the prefetch thread
+  struct Queued {
+    nlohmann::json row;
+    size_t cursor_row;
+    const ReplayPlan *plan; // of the row's schema segment
+    size_t bytes;
+  };
+
+  // State shared with the prefetch thread
+  struct Prefetch {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Queued> queue;
+    bool done = false;
+    std::exception_ptr error; // raised while reading ahead
+    ReplayStatistics stats;   // of the cursor, as of the last row queued
+    std::atomic<bool> stop{false};
+    std::thread thread;
+  };
+
+  size_t _prefetch_rows = 0;
+  std::unique_ptr<Prefetch> _prefetch;
+
+  void start_prefetch() {
+    _prefetch = std::make_unique<Prefetch>();
+    _prefetch->thread = std::thread([this]() { prefetch_loop(); });
+  }
+
+  // Producer: owns _cursor until stop_prefetch() joins it. Budget for a row
+  // is reserved from its raw line before it is parsed, so rows shed under
+  // ReplayOverflow::shed cost no tokenizing or building.
+  void prefetch_loop() {
+    ReplayTrace::set_thread_name("replay-prefetch");
+    Prefetch &p = *_prefetch;
+    for (;;) {
+      {
+        ReplayTraceSpan span("wait");
+        std::unique_lock<std::mutex> lock(p.mutex);
+        p.cv.wait(lock, [&]() {
+          return p.stop || p.queue.size() < _prefetch_rows;
+        });
+        if (p.stop) {
+          break;
         }
-        // otherwise skip the ']' (remove it)
-      } else if (c == '.' || c == '[') {
-        output.push_back('/');
-      } else {
-        output.push_back(c);
       }
+      if (!_cursor.has_next()) {
+        if (!_loop_enabled) {
+          break;
+        }
+        _cursor.reset();
+        if (!_cursor.has_next()) {
+          break;
+        }
+      }
+      size_t row = _cursor.tell();
+      Queued item;
+      item.bytes = 0;
+      try {
+        std::string_view line;
+        if (!_cursor.next_line(line)) {
+          continue; // the rest of a key shard belongs to other workers
+        }
+        row = _cursor.tell() - 1;
+        // Approximate footprint of the parsed row
+        item.bytes = sizeof(Queued) + line.size() +
+                     _cursor.plan().size() * (sizeof(nlohmann::json) + 16);
+        if (!_budget->acquire(item.bytes, &p.stop)) {
+          if (p.stop) {
+            // Not consumed: make sure it is read again after restart
+            _cursor.seek(row);
+            break;
+          }
+          continue; // shed
+        }
+        if (!_cursor.parse_row(line, item.row)) {
+          _budget->release(item.bytes);
+          continue; // dropped by the error policy
+        }
+      } catch (...) {
+        _budget->release(item.bytes);
+        // Handed to the consumer once the rows before it are taken
+        std::lock_guard<std::mutex> lock(p.mutex);
+        p.error = std::current_exception();
+        p.stats = _cursor.statistics();
+        break;
+      }
+      publish_metrics(false);
+      item.cursor_row = row;
+      item.plan = &_cursor.plan();
+      std::lock_guard<std::mutex> lock(p.mutex);
+      p.queue.push_back(std::move(item));
+      p.stats = _cursor.statistics();
+      _metrics->queue_depth.store(p.queue.size(), std::memory_order_relaxed);
+      p.cv.notify_all();
     }
-    if (output[0] != '/') {
-      output = "/" + output;
+    publish_metrics(true);
+    std::lock_guard<std::mutex> lock(p.mutex);
+    p.stats = _cursor.statistics();
+    p.done = true;
+    p.cv.notify_all();
+  }
+
+  bool prefetched_advance(nlohmann::json &row, size_t &cursor_row,
+                          const ReplayPlan *&plan) {
+    if (!_prefetch) {
+      start_prefetch();
     }
-    return output;
+    Queued item;
+    {
+      ReplayTraceSpan span("wait");
+      std::unique_lock<std::mutex> lock(_prefetch->mutex);
+      _prefetch->cv.wait(lock, [this]() {
+        return !_prefetch->queue.empty() || _prefetch->done;
+      });
+      if (_prefetch->queue.empty()) {
+        if (_prefetch->error) {
+          std::exception_ptr error = _prefetch->error;
+          _prefetch->error = nullptr;
+          std::rethrow_exception(error);
+        }
+        return false;
+      }
+      item = std::move(_prefetch->queue.front());
+      _prefetch->queue.pop_front();
+      _metrics->queue_depth.store(_prefetch->queue.size(),
+                                  std::memory_order_relaxed);
+      _prefetch->cv.notify_all();
+    }
+    _budget->release(item.bytes);
+    row = std::move(item.row);
+    cursor_row = item.cursor_row;
+    plan = item.plan;
+    return true;
   }
 
-  nlohmann::json::json_pointer pointer_from_string(std::string &path) {
-    nlohmann::json::json_pointer ptr(normalize_keypath(path));
-    return ptr;
+  // Next row from the lookahead window, the prefetch queue or the cursor,
+  // with the cursor row it was read from and the plan it was built with
+  bool next_row(nlohmann::json &row, size_t &cursor_row,
+                const ReplayPlan *&plan) {
+    if (!_ahead.empty()) {
+      row = std::move(_ahead.front().row);
+      cursor_row = _ahead.front().cursor_row;
+      plan = _ahead.front().plan;
+      _ahead.pop_front();
+      return true;
+    }
+    if (_prefetch_rows > 0) {
+      return prefetched_advance(row, cursor_row, plan);
+    }
+    if (!read_row(row)) {
+      return false;
+    }
+    cursor_row = _cursor.tell() - 1; // after a possible loop wrap-around
+    plan = &_cursor.plan();
+    return true;
   }
 
-  nlohmann::json build_json_from_row(const std::vector<std::string> &row) {
-    nlohmann::json result = nlohmann::json::object();
-    for (size_t i = 0; i < _headers.size() && i < row.size(); ++i) {
-      const nlohmann::json::json_pointer &header = _headers[i];
-      const std::string &value = row[i];
-      if (is_numeric(value)) {
-        result[header] = parse_number(value);
+  // Next row out of the reorder buffer. A row read from an earlier cursor
+  // row than the previous one means the loop wrapped around: the buffer is
+  // drained before the new cycle starts.
+  bool reordered_row(nlohmann::json &row) {
+    const std::string &keypath = _source->plan().keypaths.at(_time_column);
+    for (;;) {
+      if (_reorder.pop(row)) {
+        return true;
+      }
+      const ReplayPlan *plan;
+      if (_reorder_held) {
+        if (_reorder.drain(row)) {
+          return true;
+        }
+        _reorder.clear();
+        row = std::move(_reorder_held->row);
+        plan = _reorder_held->plan;
+        _reorder_held.reset();
       } else {
-        result[header] = value;
+        size_t cursor_row;
+        if (!next_row(row, cursor_row, plan)) {
+          return _reorder.drain(row);
+        }
+        const bool wrapped = cursor_row < _reorder_row;
+        _reorder_row = cursor_row;
+        if (wrapped && !_reorder.empty()) {
+          _reorder_held = std::make_unique<Ahead>(
+              Ahead{std::move(row), cursor_row, plan});
+          continue;
+        }
+      }
+      // The time column is looked up in the row's own schema segment; rows
+      // without a finite numeric timestamp are pushed with NaN
+      double t = std::numeric_limits<double>::quiet_NaN();
+      const size_t column = plan->column_index(keypath);
+      if (column != ReplayPlan::npos && !plan->invalid[column]) {
+        const auto &pointer = plan->pointers[column];
+        if (row.contains(pointer) && row.at(pointer).is_number()) {
+          t = row.at(pointer).get<double>();
+        }
       }
+      _reorder.push(std::move(row), t);
     }
-    return result;
   }
 
+  void clear_reorder() {
+    _reorder.clear();
+    _reorder_held.reset();
+    _reorder_row = 0;
+  }
 
-  bool is_numeric(const std::string &str) {
-    if (str.empty())
-      return false;
+  // Read a row from the cursor (no prefetch thread), wrapping around in
+  // loop mode. Rows going back in time restart the pacing schedule.
+  bool read_row(nlohmann::json &row) {
+    if (_cursor.next_row(row)) {
+      publish_metrics(false);
+      return true;
+    }
+    if (_loop_enabled) {
+      _cursor.reset();
+      if (_cursor.next_row(row)) {
+        publish_metrics(false);
+        return true;
+      }
+    }
+    publish_metrics(true);
+    return false;
+  }
 
-    char *end;
-    std::strtod(str.c_str(), &end);
-    return end == str.c_str() + str.length();
+  // Parse rows into the lookahead window until it is full or the deadline
+  // comes
+  void fill_lookahead(std::chrono::steady_clock::time_point due) {
+    while (_ahead.size() < _realtime.lookahead &&
+           std::chrono::steady_clock::now() < due) {
+      Ahead item;
+      if (!read_row(item.row)) {
+        break;
+      }
+      item.cursor_row = _cursor.tell() - 1;
+      item.plan = &_cursor.plan();
+      _ahead.push_back(std::move(item));
+    }
   }
 
-  double parse_number(const std::string &str) {
-    return std::strtod(str.c_str(), nullptr);
+  // Stop the producer and move the cursor back to the first row that was
+  // queued (or parsed into the lookahead window) but not consumed
+  void stop_prefetch() {
+    if (!_ahead.empty()) {
+      _cursor.seek(_ahead.front().cursor_row);
+      _ahead.clear();
+    }
+    if (!_prefetch) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_prefetch->mutex);
+      _prefetch->stop = true;
+      _prefetch->cv.notify_all();
+    }
+    _budget->wake();
+    _prefetch->thread.join();
+    if (!_prefetch->queue.empty()) {
+      _cursor.seek(_prefetch->queue.front().cursor_row);
+      for (const auto &item : _prefetch->queue) {
+        _budget->release(item.bytes);
+      }
+    }
+    _prefetch.reset();
+    _metrics->queue_depth.store(0, std::memory_order_relaxed);
   }
 
-  // Check if a line is a comment (starts with '#' with optional leading spaces)
-  bool is_comment_line(const std::string &line) {
-    // Find first non-space character
-    size_t first_char = line.find_first_not_of(' ');
-    if (first_char == std::string::npos) {
-      return false; // Empty line or only spaces - not a comment
+  // The row index is a cache built on first use; account for it once
+  void charge_index() {
+    if (!_index_charged) {
+      _budget->charge(_source->row_count() * sizeof(size_t));
+      _index_charged = true;
     }
-    return line[first_char] == '#';
   }
 
-  // Check if a line is empty or contains only whitespace
-  bool is_empty_line(const std::string &line) {
-    return line.find_first_not_of(" \t\r\n") == std::string::npos;
+  // Wait until the row is due according to its timestamp and the speed. The
+  // first row (and any row going back in time, e.g. on loop) restarts the
+  // schedule.
+  void pace(const nlohmann::json &row) {
+    if (_speed <= 0.0) {
+      return;
+    }
+    const auto &pointer = _source->plan().pointers.at(_time_column);
+    if (!row.contains(pointer) || !row.at(pointer).is_number()) {
+      return;
+    }
+    double t = row.at(pointer).get<double>();
+    auto now = std::chrono::steady_clock::now();
+    if (!_pace_started || t < _pace_t0) {
+      _pace_started = true;
+      _pace_t0 = t;
+      _pace_wall0 = now;
+      return;
+    }
+    auto due = _pace_wall0 + std::chrono::duration_cast<
+                                 std::chrono::steady_clock::duration>(
+                                 std::chrono::duration<double>(
+                                     (t - _pace_t0) / _speed));
+    _metrics->lag_ns.store(
+        std::max<int64_t>(
+            0, std::chrono::duration_cast<std::chrono::nanoseconds>(now - due)
+                   .count()),
+        std::memory_order_relaxed);
+    if (due > now) {
+      if (_realtime.lookahead > 0 && _prefetch_rows == 0) {
+        ReplayTraceSpan span("lookahead");
+        fill_lookahead(due);
+      }
+      ReplayTraceSpan span("pace");
+      std::this_thread::sleep_until(due);
+    }
+  }
+
+  // Called by the thread owning the cursor after each row it reads; the
+  // last row of the file is always published
+  void publish_metrics(bool force) {
+    if (!force && _cursor.has_next() &&
+        ++_unpublished < ReplayMetrics::publish_interval) {
+      return;
+    }
+    _unpublished = 0;
+    _metrics->publish(_cursor.statistics(), _budget->used());
+  }
+
+  // Write prefix, then bytes [begin, end) of the source file, to path
+  static void copy_range(const ReplaySource &source, const std::string &prefix,
+                         size_t begin, size_t end, const std::string &path) {
+#if defined(__linux__)
+    struct Fd {
+      int fd;
+      ~Fd() {
+        if (fd >= 0) {
+          ::close(fd);
+        }
+      }
+    };
+    Fd out{::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if (out.fd < 0) {
+      throw std::runtime_error("Failed to open output file: " + path);
+    }
+    auto write_all = [&out, &path](const char *data, size_t size) {
+      while (size > 0) {
+        ssize_t n = ::write(out.fd, data, size);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          throw std::runtime_error("Write error: " + path);
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+      }
+    };
+    write_all(prefix.data(), prefix.size());
+    Fd in{::open(source.path().c_str(), O_RDONLY | O_CLOEXEC)};
+    off_t offset = static_cast<off_t>(begin);
+    size_t left = end - begin;
+    while (in.fd >= 0 && left > 0) {
+      ssize_t n = ::copy_file_range(in.fd, &offset, out.fd, nullptr, left, 0);
+      if (n <= 0) {
+        // Not supported for these files (e.g. across filesystems before
+        // Linux 5.3): sendfile copies in the kernel too
+        n = ::sendfile(out.fd, in.fd, &offset, left);
+      }
+      if (n <= 0) {
+        break;
+      }
+      left -= static_cast<size_t>(n);
+    }
+    // Whatever could not be copied in the kernel comes from the mapping
+    write_all(source.data() + (end - left), left);
+#else
+    std::ofstream out(path, std::ios::binary);
+    out << prefix;
+    out.write(source.data() + begin, static_cast<std::streamsize>(end - begin));
+    if (!out) {
+      throw std::runtime_error("Write error: " + path);
+    }
+#endif
+  }
+
+  // Count the number of data rows in the file (excluding header and comments)
+  size_t count_data_rows() {
+    charge_index();
+    return _cursor.count_rows();
   }
 };
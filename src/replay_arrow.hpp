@@ -0,0 +1,411 @@
+/*
+Apache Arrow C Data Interface export for Replay.
+Fills ArrowSchema/ArrowArray structs straight from the tokenized CSV fields,
+without building nlohmann::json objects and without depending on the Arrow
+library. Nested keypaths become struct columns and array indices become
+fixed-size list columns.
+AUthor: Paolo Bosetti, University of Trento
+License: MIT
+*/
+
+#pragma once
+
+#include "replay.hpp"
+
+#include <cstdint>
+#include <limits>
+
+// Structures as defined by the Arrow C Data Interface specification
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  // Array type description
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowSchema *);
+  // Opaque producer-specific data
+  void *private_data;
+};
+
+struct ArrowArray {
+  // Array data description
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowArray *);
+  // Opaque producer-specific data
+  void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+class ReplayArrow {
+public:
+  // Read up to max_rows rows from cursor and export them as one struct
+  // array, whose fields follow the header keypaths. A batch ends at a schema
+  // segment change, so that all its rows share one header. Returns the
+  // number of exported rows; when it is 0, schema and array are left
+  // untouched.
+  // Ownership of schema and array passes to the caller, who must call their
+  // release callbacks (or hand them to an Arrow importer).
+  static size_t export_batch(ReplayCursor &cursor, size_t max_rows,
+                             ArrowSchema *schema, ArrowArray *array) {
+    const ReplayPlan &plan = cursor.next_plan();
+    const size_t ncols = plan.pointers.size();
+
+    // Tokenize rows straight into per-column UTF-8 buffers
+    std::vector<Column> columns(ncols);
+    std::vector<std::string> fields;
+    std::string_view line;
+    size_t rows = 0;
+    while (rows < max_rows && &cursor.next_plan() == &plan &&
+           cursor.next_line(line)) {
+      cursor.source().with_tokenizer([&line, &fields](auto tokenizer) {
+        tokenizer.split_line(line, fields);
+      });
+      for (size_t c = 0; c < ncols; ++c) {
+        columns[c].append(c < fields.size() ? &fields[c] : nullptr);
+      }
+      ++rows;
+    }
+    if (rows == 0) {
+      return 0;
+    }
+
+    Node root = build_tree(plan);
+    std::vector<const Node *> set{&root};
+    export_schema(root, set, columns, "", schema);
+    export_array(set, columns, rows, array);
+    return rows;
+  }
+
+private:
+  // Cells of one CSV column, laid out as an Arrow utf8 array
+  struct Column {
+    std::string chars;
+    std::vector<int32_t> offsets{0};
+    std::vector<bool> present;
+
+    void append(const std::string *value) {
+      if (value) {
+        if (chars.size() + value->size() >
+            static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+          throw std::runtime_error("Arrow batch exceeds 2 GB of text");
+        }
+        chars.append(*value);
+      }
+      offsets.push_back(static_cast<int32_t>(chars.size()));
+      present.push_back(value != nullptr);
+    }
+
+    size_t length() const { return present.size(); }
+
+    std::string_view cell(size_t row) const {
+      return std::string_view(chars.data() + offsets[row],
+                              offsets[row + 1] - offsets[row]);
+    }
+  };
+
+  // Keypath tree: leaves refer to a column, inner nodes are structs or lists
+  struct Node {
+    std::string name;
+    int column = -1;
+    bool is_list = false;
+    std::vector<Node> children;
+
+    bool is_leaf() const { return column >= 0; }
+  };
+
+  // Ownership of the buffers behind an exported ArrowArray
+  struct ArrayData {
+    std::vector<uint8_t> validity;
+    std::vector<double> values;
+    std::vector<int32_t> offsets;
+    std::string chars;
+    std::vector<const void *> buffers;
+    std::vector<ArrowArray *> children;
+  };
+
+  // Ownership of the strings behind an exported ArrowSchema
+  struct SchemaData {
+    std::string format;
+    std::string name;
+    std::vector<ArrowSchema *> children;
+  };
+
+  static std::vector<std::string> split_pointer(const std::string &pointer) {
+    std::vector<std::string> tokens;
+    size_t pos = 1;
+    while (pos <= pointer.size()) {
+      size_t slash = pointer.find('/', pos);
+      if (slash == std::string::npos) {
+        slash = pointer.size();
+      }
+      std::string token = pointer.substr(pos, slash - pos);
+      // Undo JSON pointer escaping
+      for (size_t i = 0; (i = token.find('~', i)) != std::string::npos; ++i) {
+        if (i + 1 < token.size()) {
+          token.replace(i, 2, token[i + 1] == '1' ? "/" : "~");
+        }
+      }
+      tokens.push_back(token);
+      pos = slash + 1;
+    }
+    return tokens;
+  }
+
+  static bool is_index(const std::string &token) {
+    return !token.empty() &&
+           std::all_of(token.begin(), token.end(),
+                       [](char c) { return c >= '0' && c <= '9'; });
+  }
+
+  static Node build_tree(const ReplayPlan &plan) {
+    Node root;
+    for (size_t c = 0; c < plan.pointers.size(); ++c) {
+      if (plan.invalid_count && plan.invalid[c]) {
+        continue; // dropped column, with no pointer
+      }
+      Node *node = &root;
+      for (const auto &token : split_pointer(plan.pointers[c].to_string())) {
+        auto it = std::find_if(
+            node->children.begin(), node->children.end(),
+            [&token](const Node &child) { return child.name == token; });
+        if (it == node->children.end()) {
+          Node child;
+          child.name = token;
+          node->children.push_back(std::move(child));
+          it = node->children.end() - 1;
+        }
+        node = &*it;
+      }
+      node->column = static_cast<int>(c);
+    }
+    mark_lists(root);
+    return root;
+  }
+
+  // Children named 0..n-1 with the same shape become a fixed-size list, as
+  // nlohmann::json turns them into arrays
+  static void mark_lists(Node &node) {
+    for (auto &child : node.children) {
+      mark_lists(child);
+    }
+    if (node.is_leaf() || node.children.empty()) {
+      return;
+    }
+    for (size_t i = 0; i < node.children.size(); ++i) {
+      if (!is_index(node.children[i].name) ||
+          node.children[i].name != std::to_string(i) ||
+          !same_shape(node.children[i], node.children[0])) {
+        return;
+      }
+    }
+    node.is_list = true;
+  }
+
+  static bool same_shape(const Node &a, const Node &b) {
+    if (a.is_leaf() != b.is_leaf() || a.is_list != b.is_list ||
+        a.children.size() != b.children.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < a.children.size(); ++i) {
+      if ((!a.is_list && a.children[i].name != b.children[i].name) ||
+          !same_shape(a.children[i], b.children[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Nodes whose instances are interleaved into one array: the element at
+  // index r * set.size() + j comes from set[j] at row r
+  using NodeSet = std::vector<const Node *>;
+
+  static NodeSet children_of(const NodeSet &set, size_t child) {
+    NodeSet result;
+    for (const Node *node : set) {
+      result.push_back(&node->children[child]);
+    }
+    return result;
+  }
+
+  static NodeSet elements_of(const NodeSet &set) {
+    NodeSet result;
+    for (const Node *node : set) {
+      for (const auto &element : node->children) {
+        result.push_back(&element);
+      }
+    }
+    return result;
+  }
+
+  // A leaf set is exported as float64 if every non-empty cell is numeric,
+  // as utf8 otherwise
+  static bool is_numeric_set(const NodeSet &set,
+                             const std::vector<Column> &columns) {
+    std::string scratch;
+    for (const Node *node : set) {
+      const Column &col = columns[node->column];
+      for (size_t r = 0; r < col.length(); ++r) {
+        std::string_view cell = col.cell(r);
+        if (cell.empty()) {
+          continue;
+        }
+        scratch.assign(cell);
+        if (!ReplayCsv::is_numeric(scratch)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static void export_schema(const Node &node, const NodeSet &set,
+                            const std::vector<Column> &columns,
+                            const std::string &name, ArrowSchema *schema) {
+    auto *data = new SchemaData();
+    data->name = name;
+    if (node.is_leaf()) {
+      data->format = is_numeric_set(set, columns) ? "g" : "u";
+    } else if (node.is_list) {
+      data->format = "+w:" + std::to_string(node.children.size());
+      auto *child = new ArrowSchema();
+      export_schema(node.children[0], elements_of(set), columns, "item",
+                    child);
+      data->children.push_back(child);
+    } else {
+      data->format = "+s";
+      for (size_t i = 0; i < node.children.size(); ++i) {
+        auto *child = new ArrowSchema();
+        export_schema(node.children[i], children_of(set, i), columns,
+                      node.children[i].name, child);
+        data->children.push_back(child);
+      }
+    }
+
+    schema->format = data->format.c_str();
+    schema->name = data->name.c_str();
+    schema->metadata = nullptr;
+    schema->flags = ARROW_FLAG_NULLABLE;
+    schema->n_children = static_cast<int64_t>(data->children.size());
+    schema->children = data->children.empty() ? nullptr : data->children.data();
+    schema->dictionary = nullptr;
+    schema->release = &release_schema;
+    schema->private_data = data;
+  }
+
+  static void export_array(const NodeSet &set,
+                           const std::vector<Column> &columns, size_t rows,
+                           ArrowArray *array) {
+    const Node &node = *set.front();
+    const size_t length = rows * set.size();
+    auto *data = new ArrayData();
+    int64_t null_count = 0;
+
+    if (node.is_leaf()) {
+      bool numeric = is_numeric_set(set, columns);
+      data->validity.assign((length + 7) / 8, 0);
+      if (numeric) {
+        data->values.resize(length);
+      } else {
+        data->offsets.reserve(length + 1);
+        data->offsets.push_back(0);
+      }
+      std::string scratch;
+      for (size_t r = 0; r < rows; ++r) {
+        for (size_t j = 0; j < set.size(); ++j) {
+          const size_t i = r * set.size() + j;
+          const Column &col = columns[set[j]->column];
+          std::string_view cell = col.cell(r);
+          bool valid = col.present[r] && !(numeric && cell.empty());
+          if (valid) {
+            data->validity[i / 8] |= static_cast<uint8_t>(1u << (i % 8));
+          } else {
+            ++null_count;
+          }
+          if (numeric) {
+            scratch.assign(cell);
+            data->values[i] = valid ? ReplayCsv::parse_number(scratch) : 0.0;
+          } else {
+            data->chars.append(cell);
+            data->offsets.push_back(static_cast<int32_t>(data->chars.size()));
+          }
+        }
+      }
+      data->buffers.push_back(null_count ? data->validity.data() : nullptr);
+      if (numeric) {
+        data->buffers.push_back(data->values.data());
+      } else {
+        data->buffers.push_back(data->offsets.data());
+        data->buffers.push_back(data->chars.data());
+      }
+    } else if (node.is_list) {
+      data->buffers.push_back(nullptr);
+      auto *child = new ArrowArray();
+      export_array(elements_of(set), columns, rows, child);
+      data->children.push_back(child);
+    } else {
+      data->buffers.push_back(nullptr);
+      for (size_t i = 0; i < node.children.size(); ++i) {
+        auto *child = new ArrowArray();
+        export_array(children_of(set, i), columns, rows, child);
+        data->children.push_back(child);
+      }
+    }
+
+    array->length = static_cast<int64_t>(length);
+    array->null_count = null_count;
+    array->offset = 0;
+    array->n_buffers = static_cast<int64_t>(data->buffers.size());
+    array->n_children = static_cast<int64_t>(data->children.size());
+    array->buffers = data->buffers.data();
+    array->children = data->children.empty() ? nullptr : data->children.data();
+    array->dictionary = nullptr;
+    array->release = &release_array;
+    array->private_data = data;
+  }
+
+  static void release_schema(ArrowSchema *schema) {
+    auto *data = static_cast<SchemaData *>(schema->private_data);
+    for (ArrowSchema *child : data->children) {
+      if (child->release) {
+        child->release(child);
+      }
+      delete child;
+    }
+    delete data;
+    schema->release = nullptr;
+  }
+
+  static void release_array(ArrowArray *array) {
+    auto *data = static_cast<ArrayData *>(array->private_data);
+    for (ArrowArray *child : data->children) {
+      if (child->release) {
+        child->release(child);
+      }
+      delete child;
+    }
+    delete data;
+    array->release = nullptr;
+  }
+};
@@ -0,0 +1,133 @@
+/*
+Binary row cache for Replay.
+A cache file holds the header keypaths followed by rows whose fields are
+already typed (numbers as doubles, everything else as strings), so replaying
+it skips tokenizing and number parsing.
+
+Layout (host byte order):
+  "RPLC", uint32 version, uint32 columns, columns x (uint32 length + keypath)
+  rows: uint32 fields, then per field uint8 tag: 1 = float64 (8 bytes),
+        2 = string (uint32 length + bytes)
+AUthor: Paolo Bosetti, University of Trento
+License: MIT
+*/
+
+#pragma once
+
+#include "replay.hpp"
+
+#include <cstdint>
+
+class ReplayCache {
+public:
+  static constexpr uint32_t version = 1;
+
+  static std::string encode_header(const ReplayPlan &plan) {
+    std::string out("RPLC");
+    put(out, version);
+    put(out, static_cast<uint32_t>(plan.keypaths.size()));
+    for (const auto &kp : plan.keypaths) {
+      put(out, static_cast<uint32_t>(kp.size()));
+      out.append(kp);
+    }
+    return out;
+  }
+
+  // Append one tokenized row to out
+  static void encode_row(const std::vector<std::string> &fields,
+                         std::string &out) {
+    put(out, static_cast<uint32_t>(fields.size()));
+    for (const auto &field : fields) {
+      if (ReplayCsv::is_numeric(field)) {
+        put(out, uint8_t(1));
+        put(out, ReplayCsv::parse_number(field));
+      } else {
+        put(out, uint8_t(2));
+        put(out, static_cast<uint32_t>(field.size()));
+        out.append(field);
+      }
+    }
+  }
+
+  template <typename T> static void put(std::string &out, const T &value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+};
+
+// Sequential reader of a cache file, with the same advance()/has_next()/
+// reset() interface as Replay
+class ReplayCacheReader {
+public:
+  explicit ReplayCacheReader(const std::string &path,
+                             ReplayHugePages pages = ReplayHugePages::none)
+      : _file(path, pages) {
+    if (_file.size() < 12 || std::memcmp(_file.data(), "RPLC", 4) != 0) {
+      throw std::runtime_error("Not a Replay cache file: " + path);
+    }
+    _pos = 4;
+    if (get<uint32_t>() != ReplayCache::version) {
+      throw std::runtime_error("Unsupported Replay cache version: " + path);
+    }
+    std::vector<std::string> keypaths(get<uint32_t>());
+    for (auto &kp : keypaths) {
+      uint32_t len = get<uint32_t>();
+      kp.assign(bytes(len), len);
+    }
+    _plan = ReplayPlan::compile(keypaths);
+    _data_begin = _pos;
+  }
+
+  const ReplayPlan &plan() const { return *_plan; }
+
+  // Bytes of the cache actually backed by huge pages
+  size_t huge_page_bytes() const { return _file.huge_page_bytes(); }
+
+  bool has_next() const { return _pos < _file.size(); }
+
+  void reset() { _pos = _data_begin; }
+
+  // Returns empty JSON object at the end of the cache
+  nlohmann::json advance() {
+    if (!has_next()) {
+      return nlohmann::json{};
+    }
+    nlohmann::json result = nlohmann::json::object();
+    uint32_t fields = get<uint32_t>();
+    for (uint32_t i = 0; i < fields; ++i) {
+      uint8_t tag = get<uint8_t>();
+      nlohmann::json value;
+      if (tag == 1) {
+        value = get<double>();
+      } else {
+        uint32_t len = get<uint32_t>();
+        value = std::string(bytes(len), len);
+      }
+      if (i < _plan->pointers.size() &&
+          !(_plan->invalid_count && _plan->invalid[i])) {
+        result[_plan->pointers[i]] = std::move(value);
+      }
+    }
+    return result;
+  }
+
+private:
+  ReplayMappedFile _file;
+  std::shared_ptr<const ReplayPlan> _plan;
+  size_t _pos = 0;
+  size_t _data_begin = 0;
+
+  const char *bytes(size_t len) {
+    if (_pos + len > _file.size()) {
+      throw std::runtime_error("Truncated Replay cache file");
+    }
+    const char *p = _file.data() + _pos;
+    _pos += len;
+    return p;
+  }
+
+  template <typename T> T get() {
+    T value;
+    std::memcpy(&value, bytes(sizeof(T)), sizeof(T));
+    return value;
+  }
+};
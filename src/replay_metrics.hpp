@@ -0,0 +1,277 @@
+/*
+Prometheus exposition of Replay metrics.
+A ReplayMetricsExporter collects the live counters of any number of Replay
+instances, labelled by name, and renders them in the Prometheus text format.
+The text can be written periodically to a file (e.g. for the node exporter
+textfile collector) or served over a Unix domain socket, where every
+connection gets one HTTP response:
+  curl --unix-socket /tmp/replay-metrics.sock http://localhost/metrics
+AUthor: Paolo Bosetti, University of Trento
+License: MIT
+*/
+
+#pragma once
+
+#include "replay.hpp"
+
+#include <array>
+#include <cstdio>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+class ReplayMetricsExporter {
+public:
+  // Rates are averaged over rate_window, whoever renders the metrics
+  explicit ReplayMetricsExporter(
+      std::chrono::milliseconds rate_window = std::chrono::seconds(10))
+      : _rate_window(rate_window) {}
+  ReplayMetricsExporter(const ReplayMetricsExporter &) = delete;
+  ReplayMetricsExporter &operator=(const ReplayMetricsExporter &) = delete;
+
+  ~ReplayMetricsExporter() { stop(); }
+
+  // Export the metrics of a replay under the label replay="<name>"
+  void add(const std::string &name,
+           std::shared_ptr<const ReplayMetrics> metrics) {
+    if (!metrics) {
+      throw std::invalid_argument("ReplayMetricsExporter requires metrics");
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.push_back(Entry{name, std::move(metrics), {}});
+    _entries.back().samples.push_back(
+        Sample{_entries.back().metrics->started, 0, 0});
+  }
+
+  // Current metrics in Prometheus text format. Rates are averaged over the
+  // last rate window (or since the replay started), from samples shared by
+  // all callers, so the file writer and any number of scrapers agree.
+  std::string text() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<std::array<double, 9>> values;
+    for (auto &e : _entries) {
+      const ReplayMetrics &m = *e.metrics;
+      const double rows = static_cast<double>(m.rows.load());
+      const double bytes = static_cast<double>(m.bytes.load());
+      // Keep the newest sample at or before the window start as the base,
+      // and at most about 100 samples inside the window
+      while (e.samples.size() > 1 &&
+             e.samples[1].time <= now - _rate_window) {
+        e.samples.pop_front();
+      }
+      if (now - e.samples.back().time >= _rate_window / 100) {
+        e.samples.push_back(Sample{now, rows, bytes});
+      }
+      const Sample &base = e.samples.front();
+      const double dt = std::max(
+          std::chrono::duration<double>(now - base.time).count(), 1e-9);
+      values.push_back({rows, bytes, (rows - base.rows) / dt,
+                        (bytes - base.bytes) / dt, m.lag_ns.load() / 1e9,
+                        static_cast<double>(m.queue_depth.load()),
+                        static_cast<double>(m.errors.load()),
+                        static_cast<double>(m.skipped.load()),
+                        static_cast<double>(m.memory.load())});
+    }
+
+    static const char *const families[][3] = {
+        {"replay_rows_total", "counter", "Data rows read"},
+        {"replay_bytes_total", "counter", "Bytes of data rows read"},
+        {"replay_rows_per_second", "gauge", "Rows read per second"},
+        {"replay_bytes_per_second", "gauge", "Bytes read per second"},
+        {"replay_lag_seconds", "gauge",
+         "Lateness of the last paced row behind its schedule"},
+        {"replay_queue_depth", "gauge", "Rows waiting in the prefetch queue"},
+        {"replay_errors_total", "counter", "Malformed rows"},
+        {"replay_skipped_total", "counter",
+         "Malformed rows skipped or quarantined"},
+        {"replay_memory_bytes", "gauge", "Bytes charged to the memory budget"},
+    };
+    std::string out;
+    char number[64];
+    for (size_t f = 0; f < 9; ++f) {
+      out += std::string("# HELP ") + families[f][0] + " " + families[f][2] +
+             "\n# TYPE " + families[f][0] + " " + families[f][1] + "\n";
+      for (size_t i = 0; i < _entries.size(); ++i) {
+        std::snprintf(number, sizeof(number), "%.17g", values[i][f]);
+        out += std::string(families[f][0]) + "{replay=" +
+               label(_entries[i].name) + "} " + number + "\n";
+      }
+    }
+    return out;
+  }
+
+  // Write the metrics to path, atomically replacing it
+  void write_file(const std::string &path) {
+    const std::string temp = path + ".tmp";
+    {
+      std::ofstream out(temp);
+      out << text();
+      if (!out) {
+        throw std::runtime_error("Failed to write metrics file: " + temp);
+      }
+    }
+    if (std::rename(temp.c_str(), path.c_str()) != 0) {
+      throw std::runtime_error("Failed to replace metrics file: " + path);
+    }
+  }
+
+  // Rewrite the file every interval on a background thread
+  void start_file(const std::string &path, std::chrono::milliseconds interval) {
+    start([this, path, interval]() {
+      std::unique_lock<std::mutex> lock(_thread_mutex);
+      while (!_stop) {
+        lock.unlock();
+        try {
+          write_file(path);
+        } catch (const std::exception &e) {
+          std::cerr << "ReplayMetricsExporter: " << e.what() << std::endl;
+        }
+        lock.lock();
+        _cv.wait_for(lock, interval, [this]() { return _stop; });
+      }
+    });
+  }
+
+#if !defined(_WIN32)
+  // Serve the metrics on a Unix domain socket from a background thread
+  void start_socket(const std::string &path) {
+    int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+      throw std::runtime_error("Failed to create metrics socket");
+    }
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      ::close(server);
+      throw std::invalid_argument("Metrics socket path too long: " + path);
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ::unlink(path.c_str());
+    if (::bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+            0 ||
+        ::listen(server, 16) != 0) {
+      ::close(server);
+      throw std::runtime_error("Failed to listen on metrics socket: " + path);
+    }
+    start([this, server, path]() {
+      while (!stopping()) {
+        pollfd pfd{server, POLLIN, 0};
+        if (::poll(&pfd, 1, 100) <= 0) {
+          continue;
+        }
+        int client = ::accept(server, nullptr, nullptr);
+        if (client >= 0) {
+#ifdef SO_NOSIGPIPE
+          int on = 1;
+          ::setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+          serve(client);
+          ::close(client);
+        }
+      }
+      ::close(server);
+      ::unlink(path.c_str());
+    });
+  }
+#endif
+
+  // Stop the background thread, if any
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(_thread_mutex);
+      _stop = true;
+      _cv.notify_all();
+    }
+    if (_thread.joinable()) {
+      _thread.join();
+    }
+  }
+
+private:
+  struct Sample {
+    std::chrono::steady_clock::time_point time;
+    double rows;
+    double bytes;
+  };
+
+  struct Entry {
+    std::string name;
+    std::shared_ptr<const ReplayMetrics> metrics;
+    std::deque<Sample> samples; // oldest first, base of the rates
+  };
+
+  const std::chrono::milliseconds _rate_window;
+  std::mutex _mutex; // guards _entries
+  std::vector<Entry> _entries;
+  std::mutex _thread_mutex;
+  std::condition_variable _cv;
+  bool _stop = false;
+  std::thread _thread;
+
+  template <typename Func> void start(Func &&func) {
+    if (_thread.joinable()) {
+      throw std::runtime_error("ReplayMetricsExporter is already running");
+    }
+    {
+      std::lock_guard<std::mutex> lock(_thread_mutex);
+      _stop = false;
+    }
+    _thread = std::thread(std::forward<Func>(func));
+  }
+
+  bool stopping() {
+    std::lock_guard<std::mutex> lock(_thread_mutex);
+    return _stop;
+  }
+
+  static std::string label(const std::string &value) {
+    std::string out = "\"";
+    for (char c : value) {
+      if (c == '\\' || c == '"') {
+        out += '\\';
+        out += c;
+      } else if (c == '\n') {
+        out += "\\n";
+      } else {
+        out += c;
+      }
+    }
+    return out + "\"";
+  }
+
+#if !defined(_WIN32)
+#ifdef MSG_NOSIGNAL
+  static constexpr int send_flags = MSG_NOSIGNAL;
+#else
+  static constexpr int send_flags = 0; // SO_NOSIGPIPE is set instead
+#endif
+
+  // Read (and ignore) the request, then answer with the metrics
+  void serve(int client) {
+    char request[1024];
+    pollfd pfd{client, POLLIN, 0};
+    if (::poll(&pfd, 1, 100) > 0) {
+      ::recv(client, request, sizeof(request), 0);
+    }
+    const std::string body = text();
+    const std::string response =
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+    const char *data = response.data();
+    size_t size = response.size();
+    while (size > 0) {
+      ssize_t n = ::send(client, data, size, send_flags);
+      if (n <= 0) {
+        return;
+      }
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+  }
+#endif
+};
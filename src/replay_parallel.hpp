@@ -0,0 +1,311 @@
+/*
+Parallel, order-preserving processing of a ReplaySource.
+The data section is cut into newline-aligned chunks that worker threads
+transform concurrently; outputs reach the sink on the calling thread in file
+order. A bounded window of chunks in flight limits memory use, and upcoming
+chunks are prefetched from disk ahead of the workers.
+With pinning enabled, workers are spread over the NUMA nodes and chunks are
+dealt to nodes round-robin: each worker prefetches (and so faults into the
+page cache) and transforms only its node's chunks, and builds its outputs
+after pinning, so their memory is first touched on the local node.
+AUthor: Paolo Bosetti, University of Trento
+License: MIT
+*/
+
+#pragma once
+
+#include "replay.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+
+struct ReplayParallelOptions {
+  size_t threads = 0;              // 0 = hardware concurrency
+  size_t chunk_bytes = 4u << 20;   // nominal chunk size
+  size_t window = 0;               // chunks in flight, 0 = 2 * threads
+  ReplayMemoryBudget *budget = nullptr; // charged with the chunks in flight
+  bool pin_threads = false;        // pin workers to cores, node by node
+  int numa_node = -1;              // run on this NUMA node only (pins)
+};
+
+class ReplayParallel {
+public:
+  // Call transform(std::string_view chunk, Output &out) on worker threads for
+  // consecutive chunks of the data section (whole lines only), and
+  // sink(Output &out) on the calling thread, in file order. Exceptions from
+  // either side stop the pipeline and are rethrown here.
+  template <typename Output, typename Transform, typename Sink>
+  static void run(const ReplaySource &source, Transform &&transform,
+                  Sink &&sink, const ReplayParallelOptions &options = {}) {
+    const Placement placement = place(options);
+    const size_t threads =
+        options.threads ? options.threads
+        : placement.cpus.empty()
+            ? std::max(1u, std::thread::hardware_concurrency())
+            : placement.cpu_count;
+    const size_t chunk_bytes = std::max<size_t>(1, options.chunk_bytes);
+    const size_t window = options.window ? options.window : 2 * threads;
+    const size_t none = static_cast<size_t>(-1);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<size_t, std::pair<Output, size_t>> ready;
+    std::atomic<bool> cancel{false};
+    // Chunks are dealt round-robin to the nodes in use: node k gets chunks
+    // k, k + nodes, k + 2 * nodes, ...
+    const size_t nodes =
+        placement.cpus.empty() ? 1 : std::min(threads, placement.cpus.size());
+    std::vector<std::atomic<size_t>> next_chunk(nodes);
+    size_t written = 0;
+    size_t next_budget = 0;
+    size_t chunk_count = none;
+    bool failed = false;
+    std::exception_ptr error;
+
+    auto worker = [&](size_t t) {
+      ReplayTrace::set_thread_name("replay-worker");
+      const size_t node = t % nodes;
+      if (!placement.cpus.empty()) {
+        // One core per worker, cycling over the cores of its node
+        const auto &cpus = placement.cpus[node];
+        ReplayCpu::pin_current_thread({cpus[(t / nodes) % cpus.size()]});
+      }
+      try {
+        for (;;) {
+          const size_t i = next_chunk[node]++ * nodes + node;
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() {
+              return failed || i < written + window || chunk_count <= i;
+            });
+            if (failed || chunk_count <= i) {
+              return;
+            }
+          }
+          const size_t begin = chunk_start(source, chunk_bytes, i);
+          if (begin >= source.size()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunk_count = std::min(chunk_count, i);
+            cv.notify_all();
+            return;
+          }
+          const size_t end = chunk_start(source, chunk_bytes, i + 1);
+          if (options.budget) {
+            // Chunks take budget in file order, so the chunk the writer
+            // waits for can never be starved by later ones
+            {
+              std::unique_lock<std::mutex> lock(mutex);
+              cv.wait(lock, [&]() { return failed || next_budget == i; });
+              if (failed) {
+                return;
+              }
+            }
+            bool granted = false;
+            {
+              ReplayTraceSpan span("wait");
+              granted = options.budget->acquire_wait(end - begin, &cancel);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            ++next_budget;
+            cv.notify_all();
+            if (!granted) {
+              return;
+            }
+          }
+          // Reader stage: have the kernel fetch the chunks the node's
+          // workers pick up next
+          if (nodes == 1) {
+            source.prefetch(end, threads * chunk_bytes);
+          } else {
+            const size_t ahead = chunk_start(source, chunk_bytes, i + nodes);
+            source.prefetch(ahead,
+                            chunk_start(source, chunk_bytes, i + nodes + 1) -
+                                ahead);
+          }
+
+          Output out{};
+          {
+            ReplayTraceSpan span("transform");
+            transform(std::string_view(source.data() + begin, end - begin),
+                      out);
+          }
+          std::lock_guard<std::mutex> lock(mutex);
+          ready.emplace(i, std::make_pair(std::move(out), end - begin));
+          cv.notify_all();
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!failed) {
+          failed = true;
+          error = std::current_exception();
+        }
+        cancel = true;
+        cv.notify_all();
+      }
+    };
+
+    source.prefetch(source.data_begin(), window * chunk_bytes);
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; ++t) {
+      pool.emplace_back(worker, t);
+    }
+
+    // Ordered writer stage
+    try {
+      for (size_t k = 0;; ++k) {
+        Output out;
+        size_t bytes = 0;
+        {
+          ReplayTraceSpan span("wait");
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&]() {
+            return failed || ready.count(k) || chunk_count <= k;
+          });
+          if (failed || (!ready.count(k) && chunk_count <= k)) {
+            break;
+          }
+          auto it = ready.find(k);
+          out = std::move(it->second.first);
+          bytes = it->second.second;
+          ready.erase(it);
+          ++written;
+          cv.notify_all();
+        }
+        {
+          ReplayTraceSpan span("sink");
+          sink(out);
+        }
+        if (options.budget) {
+          options.budget->release(bytes);
+        }
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!failed) {
+        failed = true;
+        error = std::current_exception();
+      }
+      cancel = true;
+      cv.notify_all();
+    }
+
+    if (options.budget) {
+      options.budget->wake();
+    }
+    for (auto &t : pool) {
+      t.join();
+    }
+    if (options.budget) {
+      // Chunks transformed but never written
+      for (const auto &entry : ready) {
+        options.budget->release(entry.second.second);
+      }
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  // Call func(std::string_view line) for every data row in a chunk, skipping
+  // comments, empty lines and the header lines of later schema segments
+  template <typename Func>
+  static void for_each_line(const ReplaySource &source, std::string_view chunk,
+                            Func &&func) {
+    source.with_tokenizer([&source, &chunk, &func](auto tokenizer) {
+      size_t pos = 0;
+      while (pos < chunk.size()) {
+        std::string_view line =
+            ReplayCsv::next_line(chunk.data(), chunk.size(), pos);
+        if (!tokenizer.is_ignorable_line(line) &&
+            !source.is_header_line(line)) {
+          func(line);
+        }
+      }
+    });
+  }
+
+  // As for_each_line, calling func(std::string_view line, const ReplayPlan
+  // &plan) with the plan of the schema segment each row belongs to
+  template <typename Func>
+  static void for_each_row(const ReplaySource &source, std::string_view chunk,
+                           Func &&func) {
+    const ReplayPlan *plan =
+        source.segment_at(static_cast<size_t>(chunk.data() - source.data()))
+            .plan.get();
+    source.with_tokenizer([&](auto tokenizer) {
+      size_t pos = 0;
+      while (pos < chunk.size()) {
+        std::string_view line =
+            ReplayCsv::next_line(chunk.data(), chunk.size(), pos);
+        if (tokenizer.is_ignorable_line(line)) {
+          continue;
+        }
+        if (source.is_header_line(line)) {
+          plan = source
+                     .segment_at(
+                         static_cast<size_t>(line.data() - source.data()))
+                     .plan.get();
+          continue;
+        }
+        func(line, *plan);
+      }
+    });
+  }
+
+private:
+  // CPUs available to the workers, per NUMA node in use (empty when
+  // workers are not pinned)
+  struct Placement {
+    std::vector<std::vector<int>> cpus;
+    size_t cpu_count = 0;
+  };
+
+  static Placement place(const ReplayParallelOptions &options) {
+    Placement placement;
+    if (!options.pin_threads && options.numa_node < 0) {
+      return placement;
+    }
+    auto nodes = ReplayCpu::numa_nodes();
+    if (options.numa_node >= 0) {
+      if (static_cast<size_t>(options.numa_node) >= nodes.size() ||
+          nodes[options.numa_node].empty()) {
+        throw std::invalid_argument("No CPUs on NUMA node " +
+                                    std::to_string(options.numa_node));
+      }
+      placement.cpus.push_back(nodes[options.numa_node]);
+    } else {
+      for (auto &cpus : nodes) {
+        if (!cpus.empty()) {
+          placement.cpus.push_back(std::move(cpus));
+        }
+      }
+    }
+    for (const auto &cpus : placement.cpus) {
+      placement.cpu_count += cpus.size();
+    }
+    return placement;
+  }
+
+  // Start of chunk i: the first line beginning at or after its nominal offset
+  static size_t chunk_start(const ReplaySource &source, size_t chunk_bytes,
+                            size_t i) {
+    const size_t begin = source.data_begin();
+    if (i == 0) {
+      return begin;
+    }
+    if (i > (source.size() - begin) / chunk_bytes) {
+      return source.size();
+    }
+    size_t pos = begin + i * chunk_bytes;
+    if (source.data()[pos - 1] == '\n') {
+      return pos;
+    }
+    const void *nl =
+        std::memchr(source.data() + pos, '\n', source.size() - pos);
+    return nl ? static_cast<size_t>(static_cast<const char *>(nl) -
+                                    source.data()) +
+                    1
+              : source.size();
+  }
+};
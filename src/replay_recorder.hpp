@@ -0,0 +1,447 @@
+/*
+Recorder: the inverse of Replay, writing JSON rows to a CSV file that Replay
+reads back. Numbers and strings replay as written, except strings that read
+as numbers and line breaks (written as spaces, since rows are lines); null
+and missing members replay as empty strings, booleans as the strings "true"
+and "false". Each row is flattened into the header's keypath
+order through a plan compiled once from the keypaths (a tree mirroring the
+row structure, so a row costs one lookup per object member in the plan).
+Numbers are formatted with std::to_chars (shortest round-trip form). Lines
+are appended to a buffer that a background thread writes to disk: the two
+buffers are swapped when one fills up, so the producer only ever waits when
+the disk cannot keep up.
+AUthor: Paolo Bosetti, University of Trento
+License: MIT
+*/
+
+#pragma once
+
+#include "replay.hpp"
+
+#include <charconv>
+#include <cstdio>
+
+struct ReplayRecorderOptions {
+  ReplayDialect dialect = ReplayDialect::comma; // automatic means comma
+  size_t buffer_bytes = 1u << 20;               // size of each buffer
+  // Buffered rows older than this are handed to the writer even if the
+  // buffer is not full (checked while recording; 0 = only when full)
+  std::chrono::milliseconds flush_interval{1000};
+};
+
+class ReplayRecorder {
+public:
+  // Record rows with the given header keypaths (in CSV notation, e.g.
+  // "position[0].latitude", or as JSON pointers)
+  ReplayRecorder(const std::string &path, std::vector<std::string> keypaths,
+                 const ReplayRecorderOptions &options = {})
+      : _path(path), _keypaths(std::move(keypaths)), _options(options) {
+    if (_keypaths.empty()) {
+      throw std::invalid_argument("ReplayRecorder requires keypaths");
+    }
+    switch (_options.dialect) {
+    case ReplayDialect::tab:
+      _delimiter = '\t';
+      break;
+    case ReplayDialect::semicolon:
+      _delimiter = ';';
+      break;
+    case ReplayDialect::pipe:
+      _delimiter = '|';
+      break;
+    default:
+      _delimiter = ',';
+      break;
+    }
+    for (size_t c = 0; c < _keypaths.size(); ++c) {
+      add_column(_root, ReplayCsv::normalize_keypath(_keypaths[c]), c);
+    }
+    _cells.resize(_keypaths.size());
+
+    append_field(_keypaths[0], _header_field, true);
+    _header_alias = alias(_keypaths[0]);
+
+    _file = std::fopen(path.c_str(), "wb");
+    if (!_file) {
+      throw std::runtime_error("Failed to open output file: " + path);
+    }
+    _front.reserve(_options.buffer_bytes + 4096);
+    _back.reserve(_options.buffer_bytes + 4096);
+    _front = _header_field;
+    for (size_t c = 1; c < _keypaths.size(); ++c) {
+      _front += _delimiter;
+      append_field(_keypaths[c], _front, false);
+    }
+    _front += '\n';
+    _handed = std::chrono::steady_clock::now();
+    _writer = std::thread([this]() { write_loop(); });
+  }
+
+  ReplayRecorder(const ReplayRecorder &) = delete;
+  ReplayRecorder &operator=(const ReplayRecorder &) = delete;
+
+  ~ReplayRecorder() {
+    try {
+      close();
+    } catch (const std::exception &e) {
+      std::cerr << "ReplayRecorder: " << e.what() << std::endl;
+    }
+  }
+
+  // Header keypaths of every leaf of row, in its iteration order: the
+  // inverse of ReplayCsv::normalize_keypath. Keys that the CSV notation
+  // cannot express (containing '.', '[', ']' or '/') give JSON pointers.
+  static std::vector<std::string> keypaths(const nlohmann::json &row) {
+    std::vector<std::string> out;
+    bool plain = true;
+    collect(row, "", "", plain, out);
+    return out;
+  }
+
+  // Append a row. Members missing from row are written as empty fields,
+  // members not in the header are ignored.
+  void record(const nlohmann::json &row) {
+    if (!_file) {
+      throw std::runtime_error("ReplayRecorder is closed: " + _path);
+    }
+    rethrow();
+    _scratch.clear();
+    for (auto &cell : _cells) {
+      cell = {0, 0};
+    }
+    flatten(_root, row);
+    const std::string_view first(_scratch.data() + _cells[0].first,
+                                 _cells[0].second - _cells[0].first);
+    if (first == _header_field) {
+      // Would be read as a new header line
+      _cells[0].first = _scratch.size();
+      _scratch += _header_alias;
+      _cells[0].second = _scratch.size();
+    } else if (first.empty() && _cells.size() == 1) {
+      // Would be an empty line, which is skipped
+      _cells[0].first = _scratch.size();
+      _scratch += "\"\"";
+      _cells[0].second = _scratch.size();
+    }
+    for (size_t c = 0; c < _cells.size(); ++c) {
+      if (c > 0) {
+        _front += _delimiter;
+      }
+      _front.append(_scratch, _cells[c].first,
+                    _cells[c].second - _cells[c].first);
+    }
+    _front += '\n';
+    ++_rows;
+    if (_front.size() >= _options.buffer_bytes) {
+      hand_over(false);
+    } else if (_options.flush_interval.count() > 0 && _rows % 64 == 0 &&
+               std::chrono::steady_clock::now() - _handed >=
+                   _options.flush_interval) {
+      hand_over(false);
+    }
+  }
+
+  // Write everything recorded so far and wait until it reaches the file
+  void flush() {
+    hand_over(true);
+    rethrow();
+  }
+
+  // Flush and close the file; recording afterwards is an error
+  void close() {
+    if (!_writer.joinable()) {
+      return;
+    }
+    std::exception_ptr error;
+    try {
+      hand_over(true);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+      _cv.notify_all();
+    }
+    _writer.join();
+    if (std::fclose(_file) != 0 && !_error) {
+      _error = std::make_exception_ptr(
+          std::runtime_error("Failed to close output file: " + _path));
+      _failed.store(true, std::memory_order_release);
+    }
+    _file = nullptr;
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    rethrow();
+  }
+
+  const std::string &path() const { return _path; }
+  const std::vector<std::string> &header() const { return _keypaths; }
+
+  // Rows recorded
+  size_t rows() const { return _rows; }
+
+private:
+  // Flattening plan: one node per object member or array element named by
+  // the keypaths; leaves refer to their column
+  struct Node {
+    std::string key;
+    bool is_index = false;
+    size_t index = 0;
+    size_t column = static_cast<size_t>(-1);
+    std::vector<Node> children;
+  };
+
+  std::string _path;
+  std::vector<std::string> _keypaths;
+  ReplayRecorderOptions _options;
+  char _delimiter = ',';
+  Node _root;
+  std::string _header_field; // first header field, as written
+  std::string _header_alias; // same text, written so as not to match it
+  std::string _scratch; // formatted fields of the current row
+  std::vector<std::pair<size_t, size_t>> _cells; // their ranges in _scratch
+  size_t _rows = 0;
+
+  std::FILE *_file = nullptr;
+  std::string _front; // filled by the producer
+  std::string _back;  // being written; empty when the writer is idle
+  std::chrono::steady_clock::time_point _handed;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  bool _stop = false;
+  std::exception_ptr _error;
+  std::atomic<bool> _failed{false}; // _error is set; checked without the lock
+  std::thread _writer;
+
+  static void add_column(Node &root, const std::string &pointer,
+                         size_t column) {
+    Node *node = &root;
+    size_t pos = 1; // after the leading '/'
+    while (pos <= pointer.size()) {
+      size_t end = pointer.find('/', pos);
+      if (end == std::string::npos) {
+        end = pointer.size();
+      }
+      std::string token = unescape(pointer.substr(pos, end - pos));
+      pos = end + 1;
+      auto it = std::find_if(node->children.begin(), node->children.end(),
+                             [&token](const Node &n) { return n.key == token; });
+      if (it == node->children.end()) {
+        Node child;
+        child.key = token;
+        child.is_index = !token.empty() &&
+                         std::all_of(token.begin(), token.end(), [](char c) {
+                           return std::isdigit(static_cast<unsigned char>(c));
+                         });
+        child.index = child.is_index ? std::stoul(token) : 0;
+        node->children.push_back(std::move(child));
+        it = node->children.end() - 1;
+      }
+      node = &*it;
+    }
+    node->column = column;
+  }
+
+  static std::string unescape(std::string token) {
+    for (size_t i = 0; (i = token.find('~', i)) != std::string::npos; ++i) {
+      if (i + 1 < token.size()) {
+        token.replace(i, 2, token[i + 1] == '1' ? "/" : "~");
+      }
+    }
+    return token;
+  }
+
+  static void collect(const nlohmann::json &value, const std::string &csv,
+                      const std::string &pointer, bool plain,
+                      std::vector<std::string> &out) {
+    if (value.is_object() && !value.empty()) {
+      for (auto it = value.begin(); it != value.end(); ++it) {
+        const std::string &key = it.key();
+        std::string escaped = key;
+        for (size_t i = 0; i < escaped.size(); ++i) {
+          if (escaped[i] == '~' || escaped[i] == '/') {
+            escaped.replace(i, 1, escaped[i] == '~' ? "~0" : "~1");
+            ++i;
+          }
+        }
+        const bool ok = plain && !key.empty() &&
+                        key.find_first_of(".[]/") == std::string::npos &&
+                        !std::all_of(key.begin(), key.end(), [](char c) {
+                          return std::isdigit(static_cast<unsigned char>(c));
+                        });
+        collect(it.value(), csv.empty() ? key : csv + "." + key,
+                pointer + "/" + escaped, ok, out);
+      }
+    } else if (value.is_array() && !value.empty()) {
+      for (size_t i = 0; i < value.size(); ++i) {
+        const std::string index = std::to_string(i);
+        collect(value[i], csv + "[" + index + "]", pointer + "/" + index,
+                plain && !csv.empty(), out);
+      }
+    } else {
+      out.push_back(plain ? csv : pointer);
+    }
+  }
+
+  void flatten(const Node &node, const nlohmann::json &value) {
+    if (node.column != static_cast<size_t>(-1) && !value.is_structured()) {
+      const size_t begin = _scratch.size();
+      format(value, node.column == 0);
+      _cells[node.column] = {begin, _scratch.size()};
+    }
+    for (const Node &child : node.children) {
+      if (value.is_object()) {
+        auto it = value.find(child.key);
+        if (it != value.end()) {
+          flatten(child, *it);
+        }
+      } else if (value.is_array() && child.is_index &&
+                 child.index < value.size()) {
+        flatten(child, value[child.index]);
+      }
+    }
+  }
+
+  void format(const nlohmann::json &value, bool first) {
+    char number[32];
+    std::to_chars_result r{number, std::errc()};
+    switch (value.type()) {
+    case nlohmann::json::value_t::number_float: {
+      const double d = value.get<double>();
+      if (!std::isfinite(d)) {
+        return; // no CSV form: empty field
+      }
+      r = std::to_chars(number, number + sizeof(number), d);
+      break;
+    }
+    case nlohmann::json::value_t::number_integer:
+      r = std::to_chars(number, number + sizeof(number),
+                        value.get<int64_t>());
+      break;
+    case nlohmann::json::value_t::number_unsigned:
+      r = std::to_chars(number, number + sizeof(number),
+                        value.get<uint64_t>());
+      break;
+    case nlohmann::json::value_t::boolean:
+      _scratch += value.get<bool>() ? "true" : "false";
+      return;
+    case nlohmann::json::value_t::string:
+      append_field(value.get_ref<const std::string &>(), _scratch, first);
+      return;
+    default:
+      return; // null
+    }
+    _scratch.append(number, r.ptr);
+  }
+
+  // Quote a field when it holds the delimiter, a quote, or could be taken
+  // for a comment
+  void append_field(const std::string &text, std::string &out,
+                    bool first) const {
+    const bool quote =
+        text.find_first_of(std::string(1, _delimiter) + "\"\r\n") !=
+            std::string::npos ||
+        (first && !text.empty() && text[0] == '#') ||
+        (!text.empty() && (std::isspace(static_cast<unsigned char>(text[0])) ||
+                           std::isspace(static_cast<unsigned char>(
+                               text.back()))));
+    if (!quote) {
+      out += text;
+      return;
+    }
+    out += quoted(text);
+  }
+
+  // Encoding of the first header name that decodes to the same text but
+  // does not start a line like the header: quoted if the header has it
+  // plain, otherwise quoted in two parts around an ordinary character
+  std::string alias(const std::string &text) const {
+    if (_header_field.empty() || _header_field[0] != '"') {
+      return '"' + _header_field + '"';
+    }
+    for (size_t k = 1; k < text.size(); ++k) {
+      const char c = text[k];
+      if (c != '"' && c != _delimiter && c != '\r' && c != '\n') {
+        std::string out = quoted(text.substr(0, k));
+        out += c;
+        if (k + 1 < text.size()) {
+          out += quoted(text.substr(k + 1));
+        }
+        return out;
+      }
+    }
+    throw std::invalid_argument("First keypath cannot be told from data: " +
+                                text);
+  }
+
+  // Quoted field, with quotes doubled; line breaks become spaces, as rows
+  // are lines
+  static std::string quoted(const std::string &text) {
+    std::string out = "\"";
+    for (char c : text) {
+      if (c == '"') {
+        out += "\"\"";
+      } else if (c == '\n' || c == '\r') {
+        out += ' ';
+      } else {
+        out += c;
+      }
+    }
+    return out + '"';
+  }
+
+  // Give the front buffer to the writer; with wait, also wait until it is
+  // on disk
+  void hand_over(bool wait) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this]() { return _back.empty() || _error; });
+    if (!_error && !_front.empty()) {
+      _front.swap(_back);
+      _cv.notify_all();
+    }
+    _handed = std::chrono::steady_clock::now();
+    if (wait) {
+      _cv.wait(lock, [this]() { return _back.empty() || _error; });
+    }
+  }
+
+  // Called for every row: takes the lock only once the writer has failed
+  void rethrow() {
+    if (!_failed.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_error) {
+      std::rethrow_exception(_error);
+    }
+  }
+
+  void write_loop() {
+    ReplayTrace::set_thread_name("replay-recorder");
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+      _cv.wait(lock, [this]() { return _stop || !_back.empty(); });
+      if (_back.empty()) {
+        return; // stopped
+      }
+      lock.unlock();
+      bool ok;
+      {
+        ReplayTraceSpan span("write");
+        ok = std::fwrite(_back.data(), 1, _back.size(), _file) ==
+                 _back.size() &&
+             std::fflush(_file) == 0;
+      }
+      lock.lock();
+      if (!ok) {
+        _error = std::make_exception_ptr(
+            std::runtime_error("Write error: " + _path));
+        _failed.store(true, std::memory_order_release);
+      }
+      _back.clear();
+      _cv.notify_all();
+    }
+  }
+};
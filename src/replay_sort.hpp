@@ -0,0 +1,397 @@
+/*
+External sort of a CSV source on its time column.
+The data section is cut into chunks that worker threads turn into sorted
+runs of (key, byte offset, length) records: only the sort column of each
+row is decoded, rows are never copied nor built into JSON. Runs stay in
+memory while they fit half of the memory budget and are spilled to
+temporary files otherwise; a k-way merge then writes the rows, as raw byte
+ranges of the mapped source, to a sorted CSV or to the binary cache. The
+other half of the budget bounds the read buffers of spilled runs, and so
+how many runs one merge reads at once (its fan-in); when there are more,
+merge passes first combine groups of them into longer spilled runs.
+Rows whose key is not numeric go last. The sort is stable.
+The key column is looked up in the header of every schema segment. In CSV
+output a segment's header line is written again whenever the merged rows
+move to a different segment, so every row keeps its own schema.
+AUthor: Paolo Bosetti, University of Trento
+License: MIT
+*/
+
+#pragma once
+
+#include "replay.hpp"
+#include "replay_cache.hpp"
+#include "replay_parallel.hpp"
+
+#include <cstdio>
+#include <queue>
+
+enum class ReplaySortFormat { csv, cache };
+
+struct ReplaySortOptions {
+  std::string column;              // sort key, "" = the first column
+  size_t memory = 256u << 20;      // budget for the sort records in memory
+  size_t threads = 0;              // 0 = hardware concurrency
+  ReplaySortFormat format = ReplaySortFormat::csv;
+  std::string temp_dir;            // spilled runs, "" = next to the output
+};
+
+struct ReplaySortStatistics {
+  size_t rows = 0;    // rows written
+  size_t runs = 0;    // sorted runs made from the input
+  size_t spilled = 0; // runs written to temporary files
+  size_t passes = 0;  // merge passes, the final one included
+};
+
+class ReplaySort {
+public:
+  static ReplaySortStatistics sort(const ReplaySource &source,
+                                   const std::string &output,
+                                   const ReplaySortOptions &options = {}) {
+    // Key column of every schema segment (npos where it is missing)
+    const std::vector<ReplaySegment> &segments = source.segments();
+    std::vector<size_t> columns;
+    for (const auto &segment : segments) {
+      columns.push_back(options.column.empty()
+                            ? 0
+                            : segment.plan->column_index(options.column));
+    }
+    if (std::all_of(columns.begin(), columns.end(),
+                    [](size_t c) { return c == ReplayPlan::npos; })) {
+      throw std::invalid_argument("Unknown sort column: " + options.column);
+    }
+    if (options.format == ReplaySortFormat::cache && segments.size() > 1) {
+      throw std::invalid_argument(
+          "The cache format cannot hold a file with header changes");
+    }
+    if (options.memory < sizeof(Record)) {
+      throw std::invalid_argument("Sort memory budget is too small");
+    }
+
+    ReplaySortStatistics stats;
+    Spill spill(temp_prefix(output, options.temp_dir));
+    std::vector<std::unique_ptr<Run>> runs;
+    size_t in_memory = 0;
+
+    // Sorted runs, in parallel. A chunk of n bytes has less than n / 2 rows
+    // (every row has at least one character and a newline), which bounds
+    // the records a worker holds.
+    ReplayParallelOptions parallel;
+    parallel.threads = options.threads;
+    const size_t threads =
+        options.threads ? options.threads
+                        : std::max(1u, std::thread::hardware_concurrency());
+    parallel.window = threads;
+    parallel.chunk_bytes = std::max<size_t>(
+        1024, options.memory / threads / sizeof(Record) * 2);
+    ReplayParallel::run<std::vector<Record>>(
+        source,
+        [&source, &columns](std::string_view chunk,
+                            std::vector<Record> &out) {
+          make_run(source, chunk, columns, out);
+        },
+        [&](std::vector<Record> &records) {
+          if (records.empty()) {
+            return;
+          }
+          const size_t bytes = records.size() * sizeof(Record);
+          if (in_memory + bytes <= options.memory / 2) {
+            in_memory += bytes;
+            runs.push_back(std::make_unique<MemoryRun>(std::move(records)));
+          } else {
+            runs.push_back(std::make_unique<FileRun>(spill.write(records)));
+            stats.spilled++;
+          }
+        },
+        parallel);
+    stats.runs = runs.size();
+
+    // Merge passes over groups of fan_in consecutive runs, until a single
+    // merge can read them all
+    const size_t fan_in = std::clamp<size_t>(
+        options.memory / 2 / (FileRun::batch * sizeof(Record)), 2, max_fan_in);
+    while (runs.size() > fan_in) {
+      std::vector<std::unique_ptr<Run>> merged;
+      for (size_t i = 0; i < runs.size(); i += fan_in) {
+        std::vector<std::unique_ptr<Run>> group(
+            std::make_move_iterator(runs.begin() + i),
+            std::make_move_iterator(
+                runs.begin() + std::min(i + fan_in, runs.size())));
+        if (group.size() == 1) {
+          merged.push_back(std::move(group.front()));
+          continue;
+        }
+        merged.push_back(std::make_unique<FileRun>(spill.merge(group)));
+        stats.spilled++;
+      }
+      runs = std::move(merged);
+      stats.passes++;
+    }
+    stats.passes++;
+
+    std::FILE *out = std::fopen(output.c_str(), "wb");
+    if (!out) {
+      throw std::runtime_error("Failed to open output file: " + output);
+    }
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> out_guard(out,
+                                                               &std::fclose);
+    std::vector<char> out_buffer(1u << 20);
+    std::setvbuf(out, out_buffer.data(), _IOFBF, out_buffer.size());
+    auto write = [out](const char *data, size_t size) {
+      if (std::fwrite(data, 1, size, out) != size) {
+        throw std::runtime_error("Write error");
+      }
+    };
+
+    std::string encoded;
+    std::vector<std::string> fields;
+    if (options.format == ReplaySortFormat::cache) {
+      encoded = ReplayCache::encode_header(source.plan());
+      write(encoded.data(), encoded.size());
+    } else {
+      write(source.data(), source.data_begin());
+      if (source.data_begin() > 0 &&
+          source.data()[source.data_begin() - 1] != '\n') {
+        write("\n", 1);
+      }
+    }
+
+    size_t segment = 0; // segment whose header was written last
+    merge(runs, [&](const Record &r) {
+      const char *line = source.data() + r.offset;
+      if (segments.size() > 1 &&
+          options.format == ReplaySortFormat::csv) {
+        const size_t s = &source.segment_at(r.offset) - segments.data();
+        if (s != segment) {
+          size_t pos = segments[s].offset;
+          std::string_view header =
+              ReplayCsv::next_line(source.data(), source.size(), pos);
+          write(header.data(), header.size());
+          write("\n", 1);
+          segment = s;
+        }
+      }
+      if (options.format == ReplaySortFormat::cache) {
+        source.with_tokenizer([&](auto tokenizer) {
+          tokenizer.split_line(std::string_view(line, r.length), fields);
+        });
+        encoded.clear();
+        ReplayCache::encode_row(fields, encoded);
+        write(encoded.data(), encoded.size());
+      } else {
+        write(line, r.length);
+        write("\n", 1);
+      }
+      stats.rows++;
+    });
+    if (std::fflush(out) != 0) {
+      throw std::runtime_error("Write error");
+    }
+    return stats;
+  }
+
+private:
+  struct Record {
+    double key;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  // Most runs read by one merge: bounds the open files
+  static constexpr size_t max_fan_in = 512;
+
+  static bool before(const Record &a, const Record &b) {
+    return a.key < b.key || (a.key == b.key && a.offset < b.offset);
+  }
+
+  static void make_run(const ReplaySource &source, std::string_view chunk,
+                       const std::vector<size_t> &columns,
+                       std::vector<Record> &out) {
+    std::vector<std::string_view> spans;
+    std::string field;
+    const ReplaySegment *segments = source.segments().data();
+    size_t column =
+        columns[&source.segment_at(chunk.data() - source.data()) - segments];
+    source.with_tokenizer([&](auto tokenizer) {
+      size_t pos = 0;
+      while (pos < chunk.size()) {
+        std::string_view line =
+            ReplayCsv::next_line(chunk.data(), chunk.size(), pos);
+        if (tokenizer.is_ignorable_line(line)) {
+          continue;
+        }
+        if (source.is_header_line(line)) {
+          column = columns[&source.segment_at(line.data() - source.data()) -
+                           segments];
+          continue;
+        }
+        // Non-numeric, missing and non-finite keys (NaN would break the
+        // ordering) all sort last
+        double key = std::numeric_limits<double>::infinity();
+        tokenizer.locate_fields(line, spans);
+        if (column < spans.size()) {
+          tokenizer.decode_field(spans[column], field);
+          if (ReplayCsv::is_numeric(field)) {
+            const double value = ReplayCsv::parse_number(field);
+            if (std::isfinite(value)) {
+              key = value;
+            }
+          }
+        }
+        out.push_back(Record{key,
+                             static_cast<uint64_t>(line.data() - source.data()),
+                             line.size()});
+      }
+    });
+    std::sort(out.begin(), out.end(), before);
+  }
+
+  // Sequential reader over a sorted run
+  struct Run {
+    virtual ~Run() = default;
+    // Current record, or nullptr when the run is exhausted
+    virtual const Record *peek() = 0;
+    virtual void next() = 0;
+  };
+
+  struct MemoryRun : Run {
+    explicit MemoryRun(std::vector<Record> records)
+        : records(std::move(records)) {}
+    const Record *peek() override {
+      return pos < records.size() ? &records[pos] : nullptr;
+    }
+    void next() override { ++pos; }
+    std::vector<Record> records;
+    size_t pos = 0;
+  };
+
+  // Spilled run. The file is opened when the merge first reads it, closed
+  // when exhausted and removed with the run.
+  struct FileRun : Run {
+    static constexpr size_t batch = 4096;
+
+    explicit FileRun(std::string path) : path(std::move(path)) {}
+    ~FileRun() override { std::remove(path.c_str()); }
+    const Record *peek() override {
+      if (!opened) {
+        file.open(path, std::ios::binary);
+        if (!file.is_open()) {
+          throw std::runtime_error("Failed to open sort run: " + path);
+        }
+        opened = true;
+        fill();
+      }
+      return pos < buffer.size() ? &buffer[pos] : nullptr;
+    }
+    void next() override {
+      if (++pos == buffer.size()) {
+        fill();
+      }
+    }
+    void fill() {
+      buffer.resize(batch);
+      file.read(reinterpret_cast<char *>(buffer.data()),
+                batch * sizeof(Record));
+      buffer.resize(static_cast<size_t>(file.gcount()) / sizeof(Record));
+      pos = 0;
+      if (buffer.empty()) {
+        file.close();
+        buffer.shrink_to_fit();
+      }
+    }
+    std::string path;
+    std::ifstream file;
+    bool opened = false;
+    std::vector<Record> buffer;
+    size_t pos = 0;
+  };
+
+  // Temporary run files, removed when the sort ends (or fails)
+  class Spill {
+  public:
+    explicit Spill(std::string prefix) : _prefix(std::move(prefix)) {}
+    ~Spill() {
+      for (const auto &path : _paths) {
+        std::remove(path.c_str());
+      }
+    }
+    std::string write(const std::vector<Record> &records) {
+      std::string path = _prefix + std::to_string(_paths.size());
+      _paths.push_back(path);
+      std::ofstream file(path, std::ios::binary);
+      file.write(reinterpret_cast<const char *>(records.data()),
+                 records.size() * sizeof(Record));
+      if (!file) {
+        throw std::runtime_error("Failed to write sort run: " + path);
+      }
+      return path;
+    }
+
+    // Merge runs into a new run file; the runs are consumed
+    std::string merge(std::vector<std::unique_ptr<Run>> &runs) {
+      std::string path = _prefix + std::to_string(_paths.size());
+      _paths.push_back(path);
+      std::ofstream file(path, std::ios::binary);
+      std::vector<Record> buffer;
+      buffer.reserve(FileRun::batch);
+      auto flush = [&]() {
+        file.write(reinterpret_cast<const char *>(buffer.data()),
+                   buffer.size() * sizeof(Record));
+        buffer.clear();
+      };
+      ReplaySort::merge(runs, [&](const Record &r) {
+        buffer.push_back(r);
+        if (buffer.size() == FileRun::batch) {
+          flush();
+        }
+      });
+      flush();
+      if (!file) {
+        throw std::runtime_error("Failed to write sort run: " + path);
+      }
+      runs.clear(); // removes their files
+      return path;
+    }
+
+  private:
+    std::string _prefix;
+    std::vector<std::string> _paths;
+  };
+
+  static std::string temp_prefix(const std::string &output,
+                                 const std::string &temp_dir) {
+    std::string name = output;
+    if (!temp_dir.empty()) {
+      size_t slash = output.find_last_of('/');
+      name = temp_dir + "/" +
+             (slash == std::string::npos ? output : output.substr(slash + 1));
+    }
+    return name + ".run";
+  }
+
+  // k-way merge; equal keys are ordered by file offset, so the sort is
+  // stable across runs
+  template <typename Func>
+  static void merge(std::vector<std::unique_ptr<Run>> &runs, Func &&emit) {
+    using Head = std::pair<Record, size_t>; // record, run
+    auto later = [](const Head &a, const Head &b) {
+      return before(b.first, a.first);
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heap(later);
+    for (size_t i = 0; i < runs.size(); ++i) {
+      if (const Record *r = runs[i]->peek()) {
+        heap.emplace(*r, i);
+      }
+    }
+    while (!heap.empty()) {
+      Head head = heap.top();
+      heap.pop();
+      emit(head.first);
+      Run &run = *runs[head.second];
+      run.next();
+      if (const Record *r = run.peek()) {
+        heap.emplace(*r, head.second);
+      }
+    }
+  }
+};
@@ -1,9 +1,19 @@
 #include "../src/replay.hpp"
+#include "../src/replay_arrow.hpp"
+#include "../src/replay_cache.hpp"
+#include "../src/replay_metrics.hpp"
+#include "../src/replay_parallel.hpp"
+#include "../src/replay_recorder.hpp"
+#include "../src/replay_sort.hpp"
 #include <cassert>
+#include <cmath>
+#include <csignal>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <vector>
+#include <sys/wait.h>
 
 // Simple test framework
 #define TEST(name) void test_##name()
@@ -73,6 +83,14 @@ int tests_total = 0;
 int tests_passed = 0;
 int tests_failed = 0;
 
+// Scratch file name unique to this process, so that tests running in
+// parallel (ctest -j) never share files
+std::string scratch(const std::string &name) {
+  const size_t dot = name.rfind('.');
+  return name.substr(0, dot) + "_" + std::to_string(::getpid()) +
+         name.substr(dot);
+}
+
 // Test basic functionality
 TEST(basic_csv_parsing) {
   Replay replay("example.csv");
@@ -372,6 +390,1525 @@ TEST(loop_toggle) {
     ASSERT_EQ(2, count);  // Should read remaining 2 rows and stop
 }
 
+TEST(shared_source_cursors) {
+  auto source = Replay::Source::open("example_with_comments.csv");
+  ASSERT_EQ(4, source->row_count());
+
+  Replay::Cursor a(source);
+  Replay::Cursor b(source);
+
+  // Cursors advance independently over the same source
+  ASSERT_EQ(1609459200.0, a.advance()["timestamp"]);
+  ASSERT_EQ(1609459201.0, a.advance()["timestamp"]);
+  ASSERT_EQ(1609459200.0, b.advance()["timestamp"]);
+  ASSERT_EQ(2, a.tell());
+  ASSERT_EQ(1, b.tell());
+
+  // A Replay can share the same source
+  Replay replay(source);
+  int count = 0;
+  replay.play([&count](const auto &) { count++; });
+  ASSERT_EQ(4, count);
+  ASSERT_EQ(1609459202.0, a.advance()["timestamp"]);
+}
+
+TEST(cursor_seek) {
+  auto source = Replay::Source::open("example_with_comments.csv");
+  Replay::Cursor cursor(source);
+
+  cursor.seek(3);
+  ASSERT_TRUE(cursor.has_next());
+  ASSERT_EQ(1609459203.0, cursor.advance()["timestamp"]);
+  ASSERT_FALSE(cursor.has_next());
+  ASSERT_TRUE(cursor.advance().empty());
+
+  cursor.seek(1);
+  ASSERT_EQ(1609459201.0, cursor.advance()["timestamp"]);
+
+  cursor.seek(10);
+  ASSERT_FALSE(cursor.has_next());
+
+  cursor.reset();
+  ASSERT_EQ(0, cursor.tell());
+  ASSERT_EQ(1609459200.0, cursor.advance()["timestamp"]);
+}
+
+TEST(concurrent_cursors) {
+  auto source = Replay::Source::open("example.csv");
+  std::vector<double> sums(4, 0.0);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < sums.size(); ++t) {
+    threads.emplace_back([&source, &sums, t]() {
+      Replay::Cursor cursor(source);
+      for (int pass = 0; pass < 100; ++pass) {
+        cursor.seek(t);
+        sums[t] += static_cast<double>(cursor.advance()["speed"]);
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+  ASSERT_EQ(4520.0, std::round(sums[0]));
+  ASSERT_EQ(4960.0, std::round(sums[3]));
+}
+
+TEST(dialect_sniffing) {
+  ASSERT_TRUE(Replay::Source::open("example.csv")->dialect() ==
+              ReplayDialect::comma);
+  ASSERT_TRUE(Replay::Source::open("example_tab.tsv")->dialect() ==
+              ReplayDialect::tab);
+  ASSERT_TRUE(Replay::Source::open("example_semicolon.csv")->dialect() ==
+              ReplayDialect::semicolon);
+  ASSERT_TRUE(Replay::Source::open("edge_case_comments.csv")->dialect() ==
+              ReplayDialect::comma);
+}
+
+TEST(dialect_parsing) {
+  Replay tsv("example_tab.tsv");
+  auto json = tsv.advance();
+  ASSERT_EQ(45.2, json["speed"]);
+  ASSERT_EQ("John Doe", json["driver"]["name"]);
+  ASSERT_EQ(2, json["signal"].size());
+  ASSERT_EQ("Jane;Roe", tsv.advance()["driver"]["name"]);
+
+  Replay ssv("example_semicolon.csv");
+  ASSERT_EQ("Doe; John", ssv.advance()["driver"]["name"]);
+  ssv.advance();
+  json = ssv.advance();
+  ASSERT_EQ("Jim, Poe", json["driver"]["name"]);
+  ASSERT_EQ(37.7751, json["position"]["latitude"]);
+
+  // Forcing the wrong dialect keeps the whole line in one column
+  Replay forced("example_semicolon.csv", ReplayDialect::comma);
+  ASSERT_EQ(1, forced.advance().size());
+
+  // Doubled quotes inside quotes stand for one quote
+  using Comma = ReplayTokenizer<ReplayCommaDialect>;
+  ASSERT_TRUE(Comma::parse_csv_line("1,\"a\"\"b\",\"\"") ==
+              (std::vector<std::string>{"1", "a\"b", ""}));
+  std::vector<std::string_view> spans;
+  Comma::locate_fields("\"x,\"\"y\"\"\",2", spans);
+  ASSERT_EQ(2u, spans.size());
+  std::string field;
+  Comma::decode_field(spans[0], field);
+  ASSERT_EQ(std::string("x,\"y\""), field);
+}
+
+struct TrimmedBackslashDialect : ReplayCommaDialect {
+  static constexpr char escape = '\\';
+  static constexpr bool trim = true;
+};
+
+TEST(custom_dialect_tokenizer) {
+  auto fields = ReplayTokenizer<TrimmedBackslashDialect>::parse_csv_line(
+      " a , \"b, c\" ,d\\,e,  \r");
+  ASSERT_EQ(4, fields.size());
+  ASSERT_EQ("a", fields[0]);
+  ASSERT_EQ(" b, c ", fields[1]);
+  ASSERT_EQ("d,e", fields[2]);
+  ASSERT_EQ("", fields[3]);
+}
+
+TEST(arrow_export) {
+  Replay replay("example.csv");
+  ArrowSchema schema;
+  ArrowArray array;
+  ASSERT_EQ(3, ReplayArrow::export_batch(replay.cursor(), 3, &schema, &array));
+
+  // Root struct with one field per top-level key
+  ASSERT_EQ(std::string("+s"), schema.format);
+  ASSERT_EQ(6, schema.n_children);
+  ASSERT_EQ(3, array.length);
+  ASSERT_EQ(std::string("timestamp"), schema.children[0]->name);
+  ASSERT_EQ(std::string("g"), schema.children[0]->format);
+  const double *timestamps =
+      static_cast<const double *>(array.children[0]->buffers[1]);
+  ASSERT_EQ(1609459202.0, timestamps[2]);
+
+  // acceleration.{x,y,z} -> struct
+  ASSERT_EQ(std::string("+s"), schema.children[1]->format);
+  ASSERT_EQ(3, schema.children[1]->n_children);
+
+  // signal[0..2] -> fixed-size list of float64, row-major
+  ASSERT_EQ(std::string("+w:3"), schema.children[2]->format);
+  ASSERT_EQ(std::string("g"), schema.children[2]->children[0]->format);
+  ArrowArray *signal = array.children[2]->children[0];
+  ASSERT_EQ(9, signal->length);
+  ASSERT_EQ(104.0, static_cast<const double *>(signal->buffers[1])[3]);
+
+  // position[0].{latitude,longitude} -> list of struct
+  ASSERT_EQ(std::string("+w:1"), schema.children[3]->format);
+  ASSERT_EQ(std::string("+s"), schema.children[3]->children[0]->format);
+
+  // driver.name -> utf8
+  ArrowSchema *name_schema = schema.children[5]->children[0];
+  ASSERT_EQ(std::string("u"), name_schema->format);
+  ArrowArray *names = array.children[5]->children[0];
+  const int32_t *offsets = static_cast<const int32_t *>(names->buffers[1]);
+  const char *chars = static_cast<const char *>(names->buffers[2]);
+  ASSERT_EQ("John Doe", std::string(chars + offsets[1], offsets[2] - offsets[1]));
+
+  schema.release(&schema);
+  array.release(&array);
+  ASSERT_TRUE(schema.release == nullptr);
+
+  // Remaining row, then the end of the data
+  ASSERT_EQ(1, ReplayArrow::export_batch(replay.cursor(), 3, &schema, &array));
+  schema.release(&schema);
+  array.release(&array);
+  ASSERT_EQ(0, ReplayArrow::export_batch(replay.cursor(), 3, &schema, &array));
+}
+
+TEST(seek_time) {
+  Replay replay("example_with_comments.csv");
+  replay.seek_time(1609459201.5);
+  ASSERT_EQ(1609459202.0, replay.advance()["timestamp"]);
+  replay.seek_time(0);
+  ASSERT_EQ(1609459200.0, replay.advance()["timestamp"]);
+  replay.seek_time(1e12);
+  ASSERT_FALSE(replay.has_next());
+
+  replay.set_time_column("driver.age");
+  ASSERT_EQ(11, replay.time_column());
+  ASSERT_THROWS(replay.set_time_column("missing"), std::invalid_argument);
+}
+
+TEST(paced_play) {
+  Replay replay("example.csv");
+  replay.set_speed(20.0); // 3 s of data in 150 ms
+  auto start = std::chrono::steady_clock::now();
+  int count = 0;
+  replay.play([&count](const auto &) { count++; });
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(4, count);
+  ASSERT_TRUE(elapsed >= std::chrono::milliseconds(140));
+  ASSERT_TRUE(elapsed < std::chrono::seconds(2));
+}
+
+TEST(parallel_ordered) {
+  auto source = Replay::Source::open("example_with_comments.csv");
+  ReplayParallelOptions options;
+  options.threads = 3;
+  options.chunk_bytes = 16; // several chunks per row: many empty chunks
+  std::vector<double> timestamps;
+  ReplayParallel::run<std::vector<double>>(
+      *source,
+      [&source](std::string_view chunk, std::vector<double> &out) {
+        std::vector<std::string> fields;
+        ReplayParallel::for_each_line(*source, chunk, [&](std::string_view line) {
+          out.push_back(source->plan().build(
+              ReplayTokenizer<ReplayCommaDialect>::parse_csv_line(line))["timestamp"]);
+        });
+      },
+      [&timestamps](std::vector<double> &out) {
+        timestamps.insert(timestamps.end(), out.begin(), out.end());
+      },
+      options);
+  ASSERT_EQ(4, timestamps.size());
+  for (size_t i = 0; i < timestamps.size(); ++i) {
+    ASSERT_EQ(1609459200.0 + i, timestamps[i]);
+  }
+
+  // Errors in workers are rethrown to the caller
+  ASSERT_THROWS(ReplayParallel::run<int>(
+                    *source,
+                    [](std::string_view, int &) {
+                      throw std::runtime_error("boom");
+                    },
+                    [](int &) {}, options),
+                std::runtime_error);
+}
+
+TEST(cache_round_trip) {
+  Replay replay("example.csv");
+  std::string bytes = ReplayCache::encode_header(replay.source()->plan());
+  std::string_view line;
+  std::vector<std::string> fields;
+  while (replay.cursor().next_line(line)) {
+    ReplayTokenizer<ReplayCommaDialect>::split_line(line, fields);
+    ReplayCache::encode_row(fields, bytes);
+  }
+  const std::string path = scratch("_test_cache.rplc");
+  std::ofstream(path, std::ios::binary) << bytes;
+
+  ReplayCacheReader cache(path);
+  replay.reset();
+  int count = 0;
+  while (cache.has_next()) {
+    ASSERT_TRUE(cache.advance() == replay.advance());
+    count++;
+  }
+  ASSERT_EQ(4, count);
+  ASSERT_TRUE(cache.advance().empty());
+  std::remove(path.c_str());
+  ASSERT_THROWS(ReplayCacheReader("example.csv"), std::runtime_error);
+}
+
+TEST(prefetch_mode) {
+  Replay replay("example_with_comments.csv");
+  replay.set_prefetch(2);
+  std::vector<double> timestamps;
+  size_t read = 0;
+  replay.play([&](const auto &json) {
+    timestamps.push_back(json["timestamp"]);
+    read = replay.statistics().rows; // safe while the thread reads ahead
+    ASSERT_TRUE(read >= timestamps.size());
+  });
+  ASSERT_EQ(4, timestamps.size());
+  ASSERT_EQ(4u, read);
+  ASSERT_EQ(1609459203.0, timestamps[3]);
+  ASSERT_FALSE(replay.has_next());
+
+  // Reset while rows are queued rewinds to the first unconsumed row
+  replay.reset();
+  ASSERT_EQ(1609459200.0, replay.advance()["timestamp"]);
+  replay.set_prefetch(0);
+  ASSERT_EQ(1609459201.0, replay.advance()["timestamp"]);
+  ASSERT_EQ(0, replay.memory_usage());
+
+  // Loop mode keeps producing
+  replay.set_prefetch(3);
+  replay.set_loop(true);
+  for (int i = 0; i < 6; i++) {
+    ASSERT_FALSE(replay.advance().empty());
+  }
+}
+
+TEST(memory_budget) {
+  // Blocking budget: the producer waits, no row is lost
+  Replay replay("example.csv");
+  replay.set_prefetch(100);
+  replay.set_memory_budget(1); // smaller than a single row
+  int count = 0;
+  replay.play([&count, &replay](const auto &) {
+    ASSERT_TRUE(replay.memory_usage() < 4096);
+    count++;
+  });
+  ASSERT_EQ(4, count);
+  ASSERT_EQ(0, replay.shed_rows());
+  ASSERT_EQ(0, replay.memory_usage());
+
+  // Shedding budget: rows that do not fit are dropped and counted
+  Replay shedding("example.csv");
+  shedding.set_memory_budget(1, ReplayOverflow::shed);
+  shedding.memory_budget().charge(1); // budget already full
+  shedding.set_prefetch(100);
+  count = 0;
+  shedding.play([&count](const auto &) { count++; });
+  ASSERT_EQ(0, count);
+  ASSERT_EQ(4, shedding.shed_rows());
+  ASSERT_EQ(0u, shedding.statistics().rows); // shed before being parsed
+
+  // Index caches are accounted when built for seeking
+  Replay indexed("example.csv");
+  indexed.seek_time(0);
+  ASSERT_EQ(4 * sizeof(size_t), indexed.memory_usage());
+
+  // Parallel chunks in flight stay within the budget and keep file order
+  ReplayMemoryBudget budget(64);
+  ReplayParallelOptions options;
+  options.threads = 4;
+  options.chunk_bytes = 16;
+  options.budget = &budget;
+  std::vector<size_t> lines;
+  ReplayParallel::run<size_t>(
+      *indexed.source(),
+      [&indexed](std::string_view chunk, size_t &out) {
+        ReplayParallel::for_each_line(*indexed.source(), chunk,
+                                      [&out](std::string_view) { out++; });
+      },
+      [&lines, &budget](size_t &out) {
+        ASSERT_TRUE(budget.used() <= 160);
+        lines.push_back(out);
+      },
+      options);
+  size_t total = 0;
+  for (size_t n : lines) {
+    total += n;
+  }
+  ASSERT_EQ(4, total);
+  ASSERT_EQ(0, budget.used());
+}
+
+TEST(error_policy_flag) {
+  Replay replay("malformed_rows.csv");
+  std::vector<ReplayRowStatus> statuses;
+  replay.play([&statuses, &replay](const auto &) {
+    statuses.push_back(replay.last_status());
+  });
+  ASSERT_EQ(4, statuses.size());
+  ASSERT_TRUE(statuses[0] == ReplayRowStatus::ok);
+  ASSERT_TRUE(statuses[1] == ReplayRowStatus::too_few_fields);
+  ASSERT_TRUE(statuses[2] == ReplayRowStatus::too_many_fields);
+  ASSERT_TRUE(statuses[3] == ReplayRowStatus::ok);
+
+  auto stats = replay.statistics();
+  ASSERT_EQ(4, stats.rows);
+  ASSERT_EQ(2, stats.errors());
+  ASSERT_EQ(0, stats.skipped);
+}
+
+TEST(error_policy_skip_and_quarantine) {
+  Replay skipping("malformed_rows.csv");
+  skipping.set_error_policy(ReplayErrorPolicy::skip);
+  std::vector<std::string> names;
+  skipping.play([&names](const auto &json) {
+    names.push_back(json["driver"]["name"]);
+  });
+  ASSERT_EQ(2, names.size());
+  ASSERT_EQ("Carol", names[1]);
+  ASSERT_EQ(2, skipping.statistics().skipped);
+
+  const std::string path = scratch("_test_quarantine.tsv");
+  {
+    Replay quarantining("malformed_rows.csv");
+    quarantining.set_error_policy(ReplayErrorPolicy::quarantine, path);
+    int count = 0;
+    quarantining.play([&count](const auto &) { count++; });
+    ASSERT_EQ(2, count);
+    ASSERT_EQ(2, quarantining.statistics().quarantined);
+  }
+  std::ifstream side(path);
+  std::string first, second;
+  std::getline(side, first);
+  std::getline(side, second);
+  ASSERT_EQ("4\ttoo_few_fields\t101,47.8", first);
+  ASSERT_EQ("5\ttoo_many_fields\t102,43.1,Bob,extra", second);
+  side.close();
+  std::remove(path.c_str());
+
+  ASSERT_THROWS(skipping.cursor().set_error_policy(ReplayErrorPolicy::quarantine),
+                std::invalid_argument);
+}
+
+TEST(bad_keypaths) {
+  // Clashing and malformed keypaths are dropped instead of throwing
+  Replay replay("bad_keypaths.csv");
+  auto json = replay.advance();
+  ASSERT_EQ(1.0, json["a"]);
+  ASSERT_EQ(3.0, json["sig"][0]);
+  ASSERT_EQ(5.0, json["ok"]);
+  ASSERT_EQ(3, json.size());
+  ASSERT_EQ(3, replay.statistics().bad_columns);
+
+  // So do the binary cache and the Arrow export
+  replay.reset();
+  std::string bytes = ReplayCache::encode_header(replay.source()->plan());
+  std::string_view line;
+  std::vector<std::string> fields;
+  replay.cursor().next_line(line);
+  ReplayTokenizer<ReplayCommaDialect>::split_line(line, fields);
+  ReplayCache::encode_row(fields, bytes);
+  const std::string cache_path = scratch("_test_bad_keypaths.rplc");
+  std::ofstream(cache_path, std::ios::binary) << bytes;
+  ASSERT_TRUE(ReplayCacheReader(cache_path).advance() == json);
+  std::remove(cache_path.c_str());
+
+  replay.reset();
+  ArrowSchema schema;
+  ArrowArray array;
+  ASSERT_EQ(1, ReplayArrow::export_batch(replay.cursor(), 8, &schema, &array));
+  ASSERT_EQ(std::string("+s"), schema.format);
+  ASSERT_EQ(3, schema.n_children);
+  ASSERT_EQ(std::string("a"), schema.children[0]->name);
+  ASSERT_EQ(std::string("+w:1"), schema.children[1]->format);
+  ASSERT_EQ(std::string("ok"), schema.children[2]->name);
+  ASSERT_EQ(5.0, static_cast<const double *>(array.children[2]->buffers[1])[0]);
+  schema.release(&schema);
+  array.release(&array);
+}
+
+TEST(plan_cache) {
+  // Same header line in both files: one compiled plan is shared
+  auto first = Replay::Source::open("example.csv");
+  size_t hits = ReplayPlanCache::hits();
+  auto second = Replay::Source::open("example.csv");
+  ASSERT_EQ(hits + 1, ReplayPlanCache::hits());
+  ASSERT_TRUE(&first->plan() == &second->plan());
+
+  // A different header gets its own plan
+  auto other = Replay::Source::open("edge_case_comments.csv");
+  ASSERT_FALSE(&first->plan() == &other->plan());
+
+  // Plans are released with the last source using them
+  size_t alive = ReplayPlanCache::size();
+  other.reset();
+  ASSERT_EQ(alive - 1, ReplayPlanCache::size());
+
+  ReplayPlanCache::set_enabled(false);
+  auto uncached = Replay::Source::open("example.csv");
+  ReplayPlanCache::set_enabled(true);
+  ASSERT_FALSE(&first->plan() == &uncached->plan());
+  ASSERT_TRUE(first->plan().keypaths == uncached->plan().keypaths);
+}
+
+TEST(lazy_row) {
+  Replay eager("example.csv");
+  Replay lazy("example.csv");
+  nlohmann::json expected = eager.advance();
+  ReplayLazyRow row = lazy.advance_lazy();
+  ASSERT_FALSE(row.empty());
+  ASSERT_EQ(12u, row.size());
+
+  // Leaves, by CSV keypath or JSON pointer
+  ASSERT_EQ(45.2, row["speed"].get<double>());
+  ASSERT_EQ("John Doe", row["/driver/name"].get<std::string>());
+  ASSERT_EQ(102, row["signal[1]"].get<int>());
+  // Subtrees are assembled from the columns below them
+  ASSERT_TRUE(row["acceleration"] == expected["acceleration"]);
+  ASSERT_TRUE(row["position"] == expected["position"]);
+  ASSERT_FALSE(row.contains("missing"));
+  ASSERT_TRUE(row.to_json() == expected);
+
+  // Quoted fields are decoded on access
+  Replay semicolon("example_semicolon.csv");
+  ASSERT_EQ("Doe; John",
+            semicolon.advance_lazy()["driver.name"].get<std::string>());
+
+  // End of file
+  Replay::Cursor cursor(lazy.source());
+  cursor.seek(cursor.source().row_count() - 1);
+  ASSERT_FALSE(cursor.advance_lazy().empty());
+  ASSERT_TRUE(cursor.advance_lazy().empty());
+}
+
+TEST(trace_export) {
+  const std::string path = scratch("trace_export_test.json");
+  ReplayTrace::start();
+  Replay replay("example.csv");
+  replay.set_prefetch(2);
+  size_t rows = 0;
+  replay.play([&rows](const nlohmann::json &) { ++rows; });
+  ReplayTrace::stop();
+  size_t spans = ReplayTrace::write(path);
+  ASSERT_TRUE(spans > 0);
+
+  // Once stopped, no more spans are recorded
+  Replay quiet("example.csv");
+  quiet.advance();
+  ASSERT_EQ(spans, ReplayTrace::write(path));
+
+  std::ifstream in(path);
+  nlohmann::json trace = nlohmann::json::parse(in);
+  std::map<std::string, size_t> counts;
+  bool named_thread = false;
+  for (const auto &event : trace["traceEvents"]) {
+    if (event["ph"] == "X") {
+      counts[event["name"].get<std::string>()]++;
+      ASSERT_TRUE(event["dur"].get<double>() >= 0);
+    } else if (event["args"]["name"] == "replay-prefetch") {
+      named_thread = true;
+    }
+  }
+  ASSERT_EQ(spans, counts["read"] + counts["tokenize"] + counts["build"] +
+                       counts["callback"] + counts["wait"] + counts["pace"]);
+  ASSERT_EQ(rows, counts["build"]);
+  ASSERT_EQ(rows, counts["callback"]);
+  ASSERT_TRUE(named_thread);
+  std::remove(path.c_str());
+}
+
+TEST(metrics_export) {
+  Replay replay("malformed_rows.csv");
+  ReplayMetricsExporter exporter;
+  exporter.add("malformed", replay.metrics());
+  replay.play([](const nlohmann::json &) {});
+  ReplayStatistics stats = replay.statistics();
+  ASSERT_EQ(stats.rows, replay.metrics()->rows.load());
+  ASSERT_EQ(stats.errors(), replay.metrics()->errors.load());
+
+  std::string text = exporter.text();
+  ASSERT_TRUE(text.find("# TYPE replay_rows_total counter") !=
+              std::string::npos);
+  ASSERT_TRUE(text.find("replay_rows_total{replay=\"malformed\"} " +
+                        std::to_string(stats.rows) + "\n") !=
+              std::string::npos);
+  ASSERT_TRUE(text.find("replay_queue_depth{replay=\"malformed\"} 0\n") !=
+              std::string::npos);
+  // Rendering again must not reset the rates seen by other readers
+  auto rate = [](const std::string &text) {
+    const std::string name = "replay_rows_per_second{replay=\"malformed\"} ";
+    return std::stod(text.substr(text.find(name) + name.size()));
+  };
+  ASSERT_TRUE(rate(text) > 0);
+  ASSERT_TRUE(rate(exporter.text()) > 0);
+
+  const std::string path = scratch("metrics_export_test.prom");
+  exporter.write_file(path);
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  ASSERT_EQ("# HELP replay_rows_total Data rows read", line);
+  std::remove(path.c_str());
+
+  // Scrape over a Unix domain socket
+  const std::string socket_path = scratch("metrics_export_test.sock");
+  exporter.start_socket(socket_path);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  ASSERT_EQ(0, ::connect(fd, reinterpret_cast<sockaddr *>(&addr),
+                         sizeof(addr)));
+  const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+  ::send(fd, request.data(), request.size(), 0);
+  std::string response;
+  char buffer[4096];
+  ssize_t n;
+  while ((n = ::recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    response.append(buffer, static_cast<size_t>(n));
+  }
+  ::close(fd);
+  exporter.stop();
+  ASSERT_EQ(0u, response.find("HTTP/1.0 200 OK"));
+  ASSERT_TRUE(response.find("replay_errors_total{replay=\"malformed\"}") !=
+              std::string::npos);
+}
+
+TEST(huge_pages) {
+  Replay reference("example.csv");
+  for (ReplayHugePages pages :
+       {ReplayHugePages::transparent, ReplayHugePages::hugetlb}) {
+    auto source = Replay::Source::open("example.csv",
+                                       ReplayDialect::automatic, pages);
+    ASSERT_TRUE(source->huge_pages() == pages);
+    ASSERT_EQ(source->row_count(), reference.source()->row_count());
+    // Whatever the kernel granted, the data must be the file's
+    ASSERT_TRUE(std::string(source->data(), source->size()) ==
+                std::string(reference.source()->data(),
+                            reference.source()->size()));
+    if (source->hugetlb()) {
+      ASSERT_TRUE(source->huge_page_bytes() >= source->size());
+    }
+    Replay replay(source);
+    reference.reset();
+    while (replay.has_next()) {
+      ASSERT_TRUE(replay.advance() == reference.advance());
+    }
+  }
+  ASSERT_EQ(0u, reference.source()->huge_page_bytes());
+}
+
+TEST(numa_placement) {
+  ASSERT_TRUE(ReplayCpu::parse_cpu_list("0-3,8,10-11\n") ==
+              std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  auto nodes = ReplayCpu::numa_nodes();
+  ASSERT_FALSE(nodes.empty());
+
+  auto source = Replay::Source::open("example_with_comments.csv");
+  auto collect = [&source](const ReplayParallelOptions &options) {
+    std::vector<double> timestamps;
+    ReplayParallel::run<std::vector<double>>(
+        *source,
+        [&source](std::string_view chunk, std::vector<double> &out) {
+          ReplayParallel::for_each_line(
+              *source, chunk, [&](std::string_view line) {
+                out.push_back(ReplayCsv::parse_number(
+                    ReplayTokenizer<ReplayCommaDialect>::parse_csv_line(
+                        line)[0]));
+              });
+        },
+        [&timestamps](std::vector<double> &out) {
+          timestamps.insert(timestamps.end(), out.begin(), out.end());
+        },
+        options);
+    return timestamps;
+  };
+  ReplayParallelOptions options;
+  options.threads = 3;
+  options.chunk_bytes = 16;
+  const std::vector<double> expected = collect(options);
+  ASSERT_EQ(4u, expected.size());
+
+  // Pinned workers, spread over the nodes or kept on the first one
+  options.pin_threads = true;
+  ASSERT_TRUE(collect(options) == expected);
+  options.pin_threads = false;
+  options.numa_node = 0;
+  ASSERT_TRUE(collect(options) == expected);
+
+  options.numa_node = static_cast<int>(nodes.size());
+  ASSERT_THROWS(collect(options), std::invalid_argument);
+}
+
+TEST(realtime_play) {
+  Replay reference("example.csv");
+  std::vector<nlohmann::json> expected;
+  reference.play([&expected](const nlohmann::json &row) {
+    expected.push_back(row);
+  });
+
+  Replay replay("example.csv");
+  ReplayRealtime options;
+  options.cpus = {0};
+  options.lookahead = 8;
+  replay.set_realtime(options);
+  replay.set_speed(200.0); // 5 ms between rows
+  std::vector<nlohmann::json> rows;
+  std::vector<size_t> read;
+  replay.play([&](const nlohmann::json &row) {
+    rows.push_back(row);
+    read.push_back(replay.statistics().rows);
+  });
+  ASSERT_TRUE(rows == expected);
+  // The wait before the second row was used to parse the rest of the file
+  ASSERT_EQ(expected.size(), read[1]);
+  // Whatever was granted, FIFO and memory locking were not requested
+  ASSERT_FALSE(replay.realtime_status().fifo);
+  ASSERT_FALSE(replay.realtime_status().memory_locked);
+
+  // Rows parsed ahead are given back to the cursor on reset
+  replay.reset();
+  replay.advance();
+  replay.advance();
+  ASSERT_TRUE(replay.advance() == expected[2]);
+
+  // Priority (when not permitted, the play still runs normally)
+  options.priority = 10;
+  options.lock_memory = true;
+  replay.set_realtime(options);
+  replay.reset();
+  rows.clear();
+  replay.play([&rows](const nlohmann::json &row) { rows.push_back(row); });
+  ASSERT_TRUE(rows == expected);
+
+  options.priority = 100;
+  ASSERT_THROWS(replay.set_realtime(options), std::invalid_argument);
+}
+
+TEST(reorder_buffer) {
+  Replay replay("out_of_order.csv");
+  replay.set_reorder(0.3);
+  std::vector<double> times;
+  replay.play([&times](const nlohmann::json &row) {
+    times.push_back(row["t"].get<double>());
+  });
+  ASSERT_TRUE(times ==
+              std::vector<double>({1.0, 1.1, 1.2, 1.3, 1.5, 1.9, 2.0, 2.1}));
+  // 1.0 arrived after 2.0: beyond the 0.3 s window
+  ASSERT_EQ(1u, replay.statistics().late);
+  ASSERT_EQ(1.8, replay.watermark());
+
+  // Each loop cycle is drained before the next one starts. play() counts
+  // cycles in file rows, so dropped rows are made up from the next cycle.
+  replay.set_loop(true);
+  replay.reset();
+  times.clear();
+  replay.play(
+      [&times](const nlohmann::json &row) {
+        times.push_back(row["t"].get<double>());
+      },
+      2);
+  ASSERT_EQ(18u, times.size());
+  ASSERT_TRUE(std::is_sorted(times.begin(), times.begin() + 8));
+  ASSERT_TRUE(std::is_sorted(times.begin() + 8, times.begin() + 16));
+  ASSERT_EQ(3u, replay.statistics().late);
+
+  ASSERT_THROWS(replay.set_reorder(-1.0), std::invalid_argument);
+
+  // A NaN timestamp (a "nan" field parses as a number) is treated as
+  // missing and must not disable the late-row check
+  ReplayReorder reorder(0.3);
+  reorder.push(nlohmann::json(1), std::nan(""));
+  reorder.push(nlohmann::json(2), 2.0);
+  ASSERT_FALSE(reorder.push(nlohmann::json(3), 0.5));
+  ASSERT_EQ(1.7, reorder.watermark());
+
+  // The time column is found in each schema segment's own header
+  Replay segments("schema_segments.csv");
+  segments.set_reorder(0.05);
+  times.clear();
+  segments.play([&times](const nlohmann::json &row) {
+    times.push_back(row["t"].get<double>());
+  });
+  ASSERT_TRUE(times == std::vector<double>({0.0, 0.1, 0.2, 0.3, 0.4}));
+}
+
+TEST(external_sort) {
+  const std::string sorted_path = scratch("external_sort_test.csv");
+  const std::string cache_path = scratch("external_sort_test.cache");
+  auto source = Replay::Source::open("out_of_order.csv");
+  ReplaySortOptions options;
+  options.column = "t";
+  options.threads = 2;
+  options.memory = 64; // a few records per run: most runs are spilled
+  ReplaySortStatistics stats =
+      ReplaySort::sort(*source, sorted_path, options);
+  ASSERT_EQ(9u, stats.rows);
+  ASSERT_TRUE(stats.spilled > 0);
+
+  Replay sorted(sorted_path);
+  std::vector<double> times;
+  std::string values;
+  sorted.play([&](const nlohmann::json &row) {
+    times.push_back(row["t"].get<double>());
+    values += row["value"].get<std::string>();
+  });
+  ASSERT_TRUE(std::is_sorted(times.begin(), times.end()));
+  ASSERT_EQ("agcbedifh", values); // stable: a before g at t = 1.0
+
+  // Binary cache output, everything in memory
+  options.memory = 256u << 20;
+  options.format = ReplaySortFormat::cache;
+  stats = ReplaySort::sort(*source, cache_path, options);
+  ASSERT_EQ(0u, stats.spilled);
+  ReplayCacheReader cache(cache_path);
+  for (double t : times) {
+    ASSERT_EQ(t, cache.advance()["t"].get<double>());
+  }
+  ASSERT_FALSE(cache.has_next());
+
+  // Many spilled runs: merge passes of bounded fan-in
+  const std::string large_path = scratch("external_sort_large.csv");
+  {
+    std::ofstream out(large_path);
+    out << "t,i\n";
+    for (int i = 0; i < 20000; ++i) {
+      out << (i * 7919) % 20000 << "," << i << "\n";
+    }
+  }
+  auto large = Replay::Source::open(large_path);
+  options.format = ReplaySortFormat::csv;
+  options.memory = 64;
+  stats = ReplaySort::sort(*large, sorted_path, options);
+  ASSERT_EQ(20000u, stats.rows);
+  ASSERT_TRUE(stats.runs > 4);
+  ASSERT_TRUE(stats.passes > 2); // fan-in 2 at this budget
+  Replay large_sorted(sorted_path);
+  double expected = 0;
+  large_sorted.play([&expected](const nlohmann::json &row) {
+    ASSERT_EQ(expected, row["t"].get<double>());
+    expected += 1;
+  });
+  ASSERT_EQ(20000.0, expected);
+  std::remove(large_path.c_str());
+
+  options.column = "missing";
+  ASSERT_THROWS(ReplaySort::sort(*source, sorted_path, options),
+                std::invalid_argument);
+
+  // Schema segments: the key is looked up per segment and rows keep their
+  // own header
+  const std::string segments_path = scratch("external_sort_segments.csv");
+  {
+    std::ofstream out(segments_path);
+    out << "t,speed\n0.4,10\n0.1,11\nt,temp,speed\n0.3,30,12\n0.0,31,13\n";
+  }
+  auto segmented = Replay::Source::open(segments_path);
+  options.format = ReplaySortFormat::csv;
+  options.memory = 64;
+  for (const std::string column : {"t", "temp"}) {
+    options.column = column;
+    ReplaySort::sort(*segmented, sorted_path, options);
+    Replay segments_sorted(sorted_path);
+    std::vector<nlohmann::json> rows;
+    segments_sorted.play(
+        [&rows](const nlohmann::json &row) { rows.push_back(row); });
+    ASSERT_EQ(4u, rows.size());
+    const std::vector<double> speeds = column == "t"
+                                           ? std::vector<double>{13, 11, 12, 10}
+                                           : std::vector<double>{12, 13, 10, 11};
+    for (size_t i = 0; i < rows.size(); ++i) {
+      ASSERT_EQ(speeds[i], rows[i]["speed"].get<double>());
+      ASSERT_EQ(rows[i]["speed"].get<double>() >= 12, rows[i].contains("temp"));
+    }
+  }
+  options.format = ReplaySortFormat::cache;
+  ASSERT_THROWS(
+      ReplaySort::sort(*segmented, cache_path, options),
+      std::invalid_argument);
+  std::remove(segments_path.c_str());
+
+  // Non-finite keys go last in file order, like non-numeric ones
+  const std::string nan_path = scratch("external_sort_nan.csv");
+  {
+    std::ofstream out(nan_path);
+    out << "t,i\n3,a\nnan,b\n1,c\nnan,d\n2,e\ninf,f\n0,g\n";
+  }
+  auto with_nan = Replay::Source::open(nan_path);
+  options.format = ReplaySortFormat::csv;
+  options.column = "t";
+  ReplaySort::sort(*with_nan, sorted_path, options);
+  Replay nan_sorted(sorted_path);
+  values.clear();
+  nan_sorted.play([&values](const nlohmann::json &row) {
+    values += row["i"].get<std::string>();
+  });
+  ASSERT_EQ("gceabdf", values);
+  std::remove(nan_path.c_str());
+  std::remove(sorted_path.c_str());
+  std::remove(cache_path.c_str());
+}
+
+TEST(hash_join) {
+  auto vehicles = std::make_shared<const ReplayJoin>("vehicles.csv", "vehicle");
+  ASSERT_EQ(3u, vehicles->size()); // the duplicate V01 is ignored
+  ASSERT_EQ(3u, vehicles->keypaths().size());
+  ASSERT_EQ(1u, vehicles->find("V02")); // quoted key, decoded on load
+  ASSERT_EQ(ReplayJoin::npos, vehicles->find("V1"));
+
+  Replay replay("telemetry.csv");
+  replay.set_join(vehicles, "vehicle");
+  nlohmann::json row = replay.advance();
+  ASSERT_EQ("Alpha", row["model"].get<std::string>());
+  ASSERT_EQ(1.5, row["calibration"]["gain"].get<double>());
+  ASSERT_EQ(10.0, row["speed"].get<double>());
+  row = replay.advance();
+  ASSERT_EQ("Beta", row["model"].get<std::string>());
+  row = replay.advance();
+  ASSERT_FALSE(row.contains("model")); // V99: no match, row unchanged
+  ASSERT_EQ(12.0, row["speed"].get<double>());
+  row = replay.advance();
+  ASSERT_EQ("Gamma", row["model"].get<std::string>());
+  ASSERT_FALSE(row.contains("calibration")); // short lookup row
+  row = replay.advance();
+  ASSERT_FALSE(row.contains("model"));
+  ASSERT_EQ(2u, replay.statistics().unmatched);
+
+  // Joined rows also come through the prefetch thread
+  replay.reset();
+  replay.set_prefetch(4);
+  size_t matched = 0;
+  replay.play([&](const nlohmann::json &r) { matched += r.contains("model"); });
+  ASSERT_EQ(3u, matched);
+
+  ASSERT_THROWS(replay.set_join(vehicles, "missing"), std::invalid_argument);
+  ASSERT_THROWS(ReplayJoin("vehicles.csv", "missing"), std::invalid_argument);
+}
+
+TEST(derived_columns) {
+  Replay replay("example.csv");
+  const ReplayPlan &plan = replay.source()->plan();
+  replay.add_derived("speed_ms", "speed / 3.6");
+  replay.add_derived("acceleration.norm",
+                     "sqrt(acceleration.x^2 + acceleration.y^2 + "
+                     "acceleration.z^2)");
+  replay.add_derived("misc.checks[0]",
+                     "-2^2 + max(`signal[0]`, signal[2]) % 100 - 10 / 4");
+  replay.add_derived("nan", "driver.name * 2");
+  nlohmann::json row = replay.advance();
+  ASSERT_EQ(45.2 / 3.6, row["speed_ms"].get<double>());
+  ASSERT_EQ(std::sqrt(2.5 * 2.5 + 1.3 * 1.3 + 0.8 * 0.8),
+            row["acceleration"]["norm"].get<double>());
+  ASSERT_EQ(2.5, row["acceleration"]["x"].get<double>()); // columns kept
+  ASSERT_EQ(-4.0 + 3.0 - 2.5, row["misc"]["checks"][0].get<double>());
+  ASSERT_TRUE(row["nan"].is_null());
+  row = replay.advance();
+  ASSERT_EQ(47.8 / 3.6, row["speed_ms"].get<double>());
+
+  // Batch evaluation, one operation at a time over whole columns
+  ReplayExpression expr("atan2(acceleration.y, acceleration.x) + 1", plan);
+  ASSERT_EQ(2u, expr.columns().size());
+  std::vector<double> x = {1.0, 2.0, -1.0}, y = {0.0, 2.0, 1.0};
+  std::vector<const double *> columns(plan.size(), nullptr);
+  columns[plan.column_index("acceleration.x")] = x.data();
+  columns[plan.column_index("acceleration.y")] = y.data();
+  std::vector<double> out(3);
+  expr.evaluate(columns.data(), 3, out.data());
+  std::vector<double> values(plan.size());
+  for (size_t i = 0; i < 3; ++i) {
+    values[plan.column_index("acceleration.x")] = x[i];
+    values[plan.column_index("acceleration.y")] = y[i];
+    ASSERT_EQ(std::atan2(y[i], x[i]) + 1, out[i]);
+    ASSERT_EQ(out[i], expr.evaluate(values.data()));
+  }
+
+  ASSERT_THROWS(replay.add_derived("x", "speed +"), std::invalid_argument);
+  ASSERT_THROWS(replay.add_derived("x", "foo(speed)"), std::invalid_argument);
+  ASSERT_THROWS(replay.add_derived("x", "missing * 2"), std::invalid_argument);
+  ASSERT_THROWS(replay.add_derived("speed", "1"), std::invalid_argument);
+  ASSERT_THROWS(replay.add_derived("speed.x", "1"), std::invalid_argument);
+  ASSERT_THROWS(replay.add_derived("speed_ms", "1"), std::invalid_argument);
+  replay.clear_derived();
+  ASSERT_FALSE(replay.advance().contains("speed_ms"));
+}
+
+TEST(schema_segments) {
+  Replay replay("schema_segments.csv");
+  replay.add_derived("kmh", "speed * 3.6");
+  std::vector<nlohmann::json> rows;
+  replay.play([&rows](const nlohmann::json &row) { rows.push_back(row); });
+  ASSERT_EQ(5u, rows.size()); // header lines are not data
+  ASSERT_FALSE(rows[1].contains("temp"));
+  ASSERT_EQ(30.0, rows[2]["temp"].get<double>());
+  ASSERT_EQ(32.0, rows[4]["temp"].get<double>()); // columns reordered
+  ASSERT_EQ(14.0, rows[4]["speed"].get<double>());
+  ASSERT_EQ(14.0 * 3.6, rows[4]["kmh"].get<double>());
+  ASSERT_TRUE(replay.last_status() == ReplayRowStatus::ok);
+
+  const auto &segments = replay.source()->segments();
+  ASSERT_EQ(5u, replay.source()->row_count());
+  ASSERT_EQ(3u, segments.size());
+  ASSERT_EQ(2u, segments[1].first_row);
+  ASSERT_EQ(4u, segments[2].first_row);
+  ASSERT_EQ(3u, segments[2].plan->size());
+
+  // Seeks land in the right segment
+  replay.cursor().seek(3);
+  ASSERT_EQ(31.0, replay.advance()["temp"].get<double>());
+  replay.seek_time(0.35);
+  ASSERT_EQ(14.0, replay.advance()["speed"].get<double>());
+  Replay::Cursor cursor(replay.source());
+  ASSERT_EQ(14.0, cursor.row_value(4, 1)); // "speed" of the first header
+
+  // Expressions on columns of a later segment are left out elsewhere
+  cursor.seek(2);
+  cursor.advance();
+  cursor.add_derived("temp_k", "temp + 273.15");
+  ASSERT_EQ(31.0 + 273.15, cursor.advance()["temp_k"].get<double>());
+  cursor.reset();
+  ASSERT_FALSE(cursor.advance().contains("temp_k"));
+  cursor.seek(4);
+  ASSERT_EQ(32.0 + 273.15, cursor.advance()["temp_k"].get<double>());
+
+  cursor.seek(4);
+  ASSERT_EQ(32.0, cursor.advance_lazy()["temp"].get<double>());
+}
+
+TEST(block_checksums) {
+  // Known CRC32C values, on both implementations
+  const std::string check = "123456789";
+  ASSERT_EQ(0xe3069283u, ReplayChecksum::crc32c(check.data(), check.size()));
+  ASSERT_EQ(0xe3069283u,
+            ReplayChecksum::crc32c_table(check.data(), check.size(), 0));
+  std::string text(1000, 'x');
+  for (size_t i = 0; i < text.size(); ++i) {
+    text[i] = static_cast<char>(i * 7);
+  }
+  ASSERT_EQ(ReplayChecksum::crc32c_table(text.data(), text.size(), 0),
+            ReplayChecksum::crc32c(text.data(), text.size()));
+  ASSERT_EQ(ReplayChecksum::crc32c(text.data(), text.size()),
+            ReplayChecksum::crc32c(text.data() + 300, 700,
+                                   ReplayChecksum::crc32c(text.data(), 300)));
+
+  const std::string path = scratch("block_checksums_test.csv");
+  {
+    std::ifstream in("example.csv");
+    std::ofstream out(path);
+    out << in.rdbuf();
+  }
+  std::remove((path + ".crc").c_str());
+
+  // First replay records the checksums and writes the sidecar
+  {
+    Replay replay(path);
+    auto integrity =
+        std::make_shared<ReplayIntegrity>(replay.source(), 64);
+    ASSERT_FALSE(integrity->loaded());
+    replay.set_integrity(integrity);
+    size_t rows = 0;
+    replay.play([&rows](const nlohmann::json &) { ++rows; });
+    ASSERT_EQ(4u, rows);
+    ASSERT_EQ(integrity->block_count(), integrity->checked());
+  }
+  std::ifstream sidecar(path + ".crc");
+  ASSERT_TRUE(sidecar.good());
+  sidecar.close();
+
+  // Later replays verify against it
+  {
+    Replay replay(path);
+    auto integrity =
+        std::make_shared<ReplayIntegrity>(replay.source(), 64);
+    ASSERT_TRUE(integrity->loaded());
+    integrity->check_all();
+  }
+
+  // Flip a byte in place (same size and modification time) in block 4
+  struct stat st;
+  ::stat(path.c_str(), &st);
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(300);
+    char c;
+    file.get(c);
+    file.seekp(300);
+    file.put(c == '1' ? '2' : '1');
+  }
+  timespec times[2] = {st.st_atim, st.st_mtim};
+  ::utimensat(AT_FDCWD, path.c_str(), times, 0);
+  {
+    Replay replay(path);
+    replay.set_prefetch(2);
+    replay.set_integrity(std::make_shared<ReplayIntegrity>(replay.source(), 64));
+    size_t rows = 0;
+    size_t block = 0;
+    try {
+      replay.play([&rows](const nlohmann::json &) { ++rows; });
+    } catch (const ReplayChecksumError &e) {
+      block = e.block();
+    }
+    ASSERT_EQ(4u, block);
+    ASSERT_TRUE(rows > 0 && rows < 4); // rows before the block came through
+  }
+  std::remove(path.c_str());
+  std::remove((path + ".crc").c_str());
+}
+
+TEST(shuffle_sample) {
+  const size_t rows = 1000;
+  auto perm = ReplaySampler::permutation(rows, 42);
+  ASSERT_TRUE(*perm == *ReplaySampler::permutation(rows, 42)); // seeded
+  ASSERT_FALSE(*perm == *ReplaySampler::permutation(rows, 43));
+  std::vector<size_t> sorted = *perm;
+  std::sort(sorted.begin(), sorted.end());
+  for (size_t i = 0; i < rows; ++i) {
+    ASSERT_EQ(i, sorted[i]); // every row exactly once
+  }
+
+  // Block shuffle: every group of 2 blocks of 100 rows covers whole blocks
+  auto blocks = ReplaySampler::block_shuffle(rows, 7, 100, 2);
+  ASSERT_EQ(rows, blocks->size());
+  for (size_t g = 0; g < rows; g += 200) {
+    std::vector<size_t> group(blocks->begin() + g, blocks->begin() + g + 200);
+    std::sort(group.begin(), group.end());
+    ASSERT_EQ(0u, group[0] % 100);
+    ASSERT_EQ(0u, group[100] % 100);
+    ASSERT_EQ(group[0] + 99, group[99]);
+  }
+  sorted = *blocks;
+  std::sort(sorted.begin(), sorted.end());
+  ASSERT_TRUE(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+
+  auto sample = ReplaySampler::sample(rows, 10, 1);
+  ASSERT_EQ(10u, sample->size());
+  ASSERT_TRUE(std::is_sorted(sample->begin(), sample->end()));
+  ASSERT_TRUE(std::adjacent_find(sample->begin(), sample->end()) ==
+              sample->end());
+  ASSERT_EQ(5u, ReplaySampler::sample(5, 10, 1)->size());
+
+  // Playback in a given order
+  Replay replay("out_of_order.csv");
+  auto order = std::make_shared<const std::vector<size_t>>(
+      std::vector<size_t>{8, 0, 4});
+  replay.set_order(order);
+  std::string values;
+  replay.play([&values](const nlohmann::json &row) {
+    values += row["value"].get<std::string>();
+  });
+  ASSERT_EQ("iae", values);
+  replay.set_loop(true);
+  values.clear();
+  replay.play([&values](const nlohmann::json &row) {
+                values += row["value"].get<std::string>();
+              },
+              2);
+  ASSERT_EQ("iaeiae", values);
+  replay.set_loop(false);
+
+  // A full permutation through the prefetch thread
+  replay.set_order(ReplaySampler::permutation(replay.source()->row_count(), 3));
+  replay.set_prefetch(3);
+  values.clear();
+  replay.play([&values](const nlohmann::json &row) {
+    values += row["value"].get<std::string>();
+  });
+  std::string letters = values;
+  std::sort(letters.begin(), letters.end());
+  ASSERT_EQ("abcdefghi", letters);
+  ASSERT_THROWS(replay.set_order(std::make_shared<const std::vector<size_t>>(
+                    std::vector<size_t>{9})),
+                std::out_of_range);
+  replay.set_order(nullptr);
+  ASSERT_EQ("a", replay.advance()["value"].get<std::string>());
+
+  // Reservoir sampling without the row index
+  Replay::Cursor cursor(replay.source());
+  auto picked = ReplaySampler::reservoir(cursor, 4, 9);
+  ASSERT_EQ(4u, picked.size());
+  Replay::Cursor again(replay.source());
+  ASSERT_TRUE(picked == ReplaySampler::reservoir(again, 4, 9));
+}
+
+TEST(shard_workers) {
+  const std::string path = scratch("shard_workers_test.csv");
+  {
+    std::ofstream out(path);
+    out << "id,key,text\n";
+    for (int i = 0; i < 1000; ++i) {
+      out << i << ",k" << i % 37 << ",\"row, " << std::string(i % 13, 'x')
+          << "\"\n";
+      if (i % 100 == 0) {
+        out << "# comment\n";
+      }
+    }
+  }
+  for (ReplayShardBy by :
+       {ReplayShardBy::rows, ReplayShardBy::bytes, ReplayShardBy::key}) {
+    std::vector<int> owner(1000, -1);
+    std::map<std::string, int> key_owner;
+    for (int w = 0; w < 3; ++w) {
+      Replay replay(path); // every worker opens the file on its own
+      replay.shard(w, 3, by, "key");
+      replay.play([&](const nlohmann::json &row) {
+        const int id = row["id"].get<int>();
+        ASSERT_EQ(-1, owner[id]); // shards are disjoint
+        owner[id] = w;
+        if (by == ReplayShardBy::key) {
+          auto it = key_owner.emplace(row["key"].get<std::string>(), w).first;
+          ASSERT_EQ(w, it->second); // a key stays with one worker
+        }
+      });
+    }
+    ASSERT_TRUE(std::count(owner.begin(), owner.end(), -1) == 0);
+    // Range shards are contiguous and balanced
+    if (by != ReplayShardBy::key) {
+      ASSERT_TRUE(std::is_sorted(owner.begin(), owner.end()));
+      for (int w = 0; w < 3; ++w) {
+        const auto n = std::count(owner.begin(), owner.end(), w);
+        ASSERT_TRUE(n > 300 && n < 370);
+      }
+    }
+  }
+
+  // Range shards starting in a later schema segment use its header
+  Replay whole("schema_segments.csv");
+  std::vector<nlohmann::json> expected;
+  whole.play([&expected](const nlohmann::json &row) { expected.push_back(row); });
+  for (ReplayShardBy by : {ReplayShardBy::rows, ReplayShardBy::bytes}) {
+    for (int workers = 1; workers <= 6; ++workers) {
+      std::vector<nlohmann::json> rows;
+      for (int w = 0; w < workers; ++w) {
+        Replay replay("schema_segments.csv");
+        replay.shard(w, workers, by);
+        replay.play([&rows](const nlohmann::json &row) { rows.push_back(row); });
+      }
+      ASSERT_TRUE(rows == expected);
+    }
+  }
+
+  // Positions are relative to the shard
+  Replay::Cursor cursor(Replay::Source::open(path));
+  cursor.shard(1, 2);
+  const nlohmann::json first = cursor.advance();
+  cursor.advance();
+  ASSERT_EQ(2u, cursor.tell());
+  cursor.seek(0);
+  ASSERT_TRUE(first == cursor.advance());
+  cursor.seek(100000);
+  ASSERT_FALSE(cursor.has_next());
+  ASSERT_EQ(1000u, first["id"].get<size_t>() + cursor.count_rows());
+
+  // Time seeks stay within the shard
+  for (ReplayShardBy by : {ReplayShardBy::rows, ReplayShardBy::bytes}) {
+    Replay::Cursor timed(Replay::Source::open(path));
+    timed.shard(1, 2, by);
+    const size_t begin = timed.advance()["id"].get<size_t>();
+    timed.seek_time(begin + 10.5);
+    ASSERT_EQ(11u, timed.tell());
+    ASSERT_EQ(begin + 11, timed.advance()["id"].get<size_t>());
+    timed.seek_time(0);
+    ASSERT_EQ(begin, timed.advance()["id"].get<size_t>());
+    timed.seek_time(1e9);
+    ASSERT_FALSE(timed.has_next());
+  }
+  cursor.set_order(std::make_shared<const std::vector<size_t>>(
+      std::vector<size_t>{2, 1}));
+  ASSERT_THROWS(cursor.seek_time(1), std::logic_error);
+
+  // Loop cycles count the shard's rows
+  Replay replay(path);
+  replay.shard(0, 4, ReplayShardBy::rows);
+  replay.set_loop(true);
+  size_t rows = 0;
+  replay.play([&rows](const nlohmann::json &) { ++rows; }, 2);
+  ASSERT_EQ(500u, rows);
+
+  ASSERT_THROWS(replay.shard(4, 4), std::invalid_argument);
+  ASSERT_THROWS(replay.shard(0, 2, ReplayShardBy::key, "missing"),
+                std::invalid_argument);
+  std::remove(path.c_str());
+}
+
+TEST(extract_range) {
+  const std::string path = scratch("extract_range_test.csv");
+  Replay replay("example_with_comments.csv");
+  replay.set_time_column("timestamp");
+  std::vector<nlohmann::json> all;
+  replay.play([&all](const nlohmann::json &row) { all.push_back(row); });
+  ASSERT_TRUE(all.size() >= 3);
+  const double t0 = all[1]["timestamp"].get<double>();
+  const double t1 = all[all.size() - 1]["timestamp"].get<double>();
+
+  // [t0, t1): rows 1 .. n-2, copied without parsing
+  ASSERT_EQ(all.size() - 2, replay.extract(t0, t1, path));
+  Replay cut(path);
+  std::vector<nlohmann::json> rows;
+  cut.play([&rows](const nlohmann::json &row) { rows.push_back(row); });
+  ASSERT_EQ(all.size() - 2, rows.size());
+  for (size_t i = 0; i < rows.size(); ++i) {
+    ASSERT_TRUE(rows[i] == all[i + 1]);
+  }
+  // The replay position is not affected
+  replay.reset();
+  ASSERT_TRUE(replay.advance() == all[0]);
+
+  // Ranges outside the data give a file with the header only
+  ASSERT_EQ(0u, replay.extract(t1 + 1, t1 + 2, path));
+  Replay empty(path);
+  ASSERT_FALSE(empty.has_next());
+  ASSERT_EQ(all.size(), replay.extract(0, t1 + 1, path));
+
+  // Later schema segments get their own header
+  Replay segments("schema_segments.csv");
+  ASSERT_EQ(2u, segments.extract(0.25, 1.0, path));
+  Replay tail(path);
+  nlohmann::json row = tail.advance();
+  ASSERT_EQ(31.0, row["temp"].get<double>());
+  ASSERT_EQ(14.0, tail.advance()["speed"].get<double>());
+
+  ASSERT_THROWS(replay.extract(2, 1, path), std::invalid_argument);
+  std::remove(path.c_str());
+}
+
+TEST(recorder_round_trip) {
+  const std::string path = scratch("recorder_test.csv");
+  Replay replay("example.csv");
+  std::vector<nlohmann::json> rows;
+  replay.play([&rows](const nlohmann::json &row) { rows.push_back(row); });
+  ASSERT_EQ(4u, rows.size());
+
+  // Keypaths found in a row are the header of the file it came from
+  ASSERT_TRUE(ReplayRecorder::keypaths(rows[0]).size() == 12u);
+  ASSERT_TRUE(ReplayRecorder::keypaths(nlohmann::json{{"a.b", 1}}) ==
+              std::vector<std::string>{"/a.b"});
+  {
+    ReplayRecorder recorder(path, replay.cursor().source().plan().keypaths);
+    for (const auto &row : rows) {
+      recorder.record(row);
+    }
+    ASSERT_EQ(4u, recorder.rows());
+  }
+  Replay back(path);
+  std::vector<nlohmann::json> read;
+  back.play([&read](const nlohmann::json &row) { read.push_back(row); });
+  ASSERT_EQ(rows.size(), read.size());
+  for (size_t i = 0; i < rows.size(); ++i) {
+    ASSERT_TRUE(read[i] == rows[i]);
+  }
+
+  // Delimiters are quoted, missing members give empty fields, buffers
+  // smaller than a row are handed over on every row
+  ReplayRecorderOptions options;
+  options.dialect = ReplayDialect::semicolon;
+  options.buffer_bytes = 16;
+  {
+    ReplayRecorder recorder(path, {"t", "name", "pos[1]"}, options);
+    recorder.record({{"t", 0.1}, {"name", "Doe; John"}, {"pos", {1, 2}}});
+    recorder.record({{"t", 2}});
+    recorder.flush();
+    for (int i = 0; i < 1000; ++i) {
+      recorder.record({{"t", i}, {"name", "x"}, {"pos", {0, -i}}});
+    }
+  }
+  Replay semi(path, ReplayDialect::semicolon);
+  nlohmann::json row = semi.advance();
+  ASSERT_EQ(0.1, row["t"].get<double>());
+  ASSERT_EQ(std::string("Doe; John"), row["name"].get<std::string>());
+  ASSERT_EQ(2.0, row["pos"][1].get<double>());
+  ASSERT_EQ(std::string(""), semi.advance()["name"].get<std::string>());
+  size_t count = 0;
+  double last = 0;
+  semi.play([&](const nlohmann::json &r) {
+    ++count;
+    last = r["pos"][1].get<double>();
+  });
+  ASSERT_EQ(1000u, count);
+  ASSERT_EQ(-999.0, last);
+
+  // Quotes, values equal to the first header name, single empty fields
+  {
+    ReplayRecorder recorder(path, {"t", "s"});
+    recorder.record({{"t", "t"}, {"s", "say \"hi\""}});
+    recorder.record({{"t", 1}, {"s", true}});
+  }
+  Replay quoted(path);
+  row = quoted.advance();
+  ASSERT_EQ(std::string("t"), row["t"].get<std::string>());
+  ASSERT_EQ(std::string("say \"hi\""), row["s"].get<std::string>());
+  ASSERT_EQ(std::string("true"), quoted.advance()["s"].get<std::string>());
+  ASSERT_EQ(1u, quoted.source()->segments().size());
+  {
+    ReplayRecorder recorder(path, {"# a,b"}); // quoted header name
+    recorder.record({{"# a,b", "# a,b"}});
+    recorder.record(nlohmann::json::object());
+    recorder.record({{"# a,b", "x"}});
+  }
+  Replay single(path);
+  std::vector<std::string> values;
+  single.play([&values](const nlohmann::json &r) {
+    values.push_back(r["/# a,b"_json_pointer].get<std::string>());
+  });
+  ASSERT_TRUE(values == (std::vector<std::string>{"# a,b", "", "x"}));
+
+#ifdef __linux__
+  // Writer failures reach the producer on a later record() or flush()
+  {
+    ReplayRecorder full("/dev/full", {"t"});
+    full.record({{"t", 1}});
+    ASSERT_THROWS(full.flush(), std::runtime_error);
+    ASSERT_THROWS(full.record({{"t", 2}}), std::runtime_error);
+    ASSERT_THROWS(full.close(), std::runtime_error);
+  }
+#endif
+  ASSERT_THROWS(ReplayRecorder("no_such_dir/out.csv", {"t"}),
+                std::runtime_error);
+  ASSERT_THROWS(ReplayRecorder(path, std::vector<std::string>{}),
+                std::invalid_argument);
+  std::remove(path.c_str());
+}
+
+TEST(parallel_segments) {
+  // Rows of every schema segment are built with their own header, also in
+  // chunks starting after a header change
+  auto source = Replay::Source::open("schema_segments.csv");
+  std::vector<nlohmann::json> expected;
+  Replay replay(source);
+  replay.play([&expected](const nlohmann::json &row) { expected.push_back(row); });
+  for (size_t chunk_bytes : {8u, 32u, 1024u}) {
+    ReplayParallelOptions options;
+    options.threads = 2;
+    options.chunk_bytes = chunk_bytes;
+    std::vector<nlohmann::json> rows;
+    ReplayParallel::run<std::vector<nlohmann::json>>(
+        *source,
+        [&source](std::string_view chunk, std::vector<nlohmann::json> &out) {
+          ReplayParallel::for_each_row(
+              *source, chunk,
+              [&out](std::string_view line, const ReplayPlan &plan) {
+                out.push_back(plan.build(
+                    ReplayTokenizer<ReplayCommaDialect>::parse_csv_line(line)));
+              });
+        },
+        [&rows](std::vector<nlohmann::json> &out) {
+          rows.insert(rows.end(), out.begin(), out.end());
+        },
+        options);
+    ASSERT_TRUE(rows == expected);
+  }
+  ASSERT_EQ(32.0, expected[4]["temp"].get<double>());
+  ASSERT_EQ(&source->segments()[2],
+            &source->segment_at(source->row_offset(4)));
+  ASSERT_EQ(&source->segments()[0], &source->segment_at(0));
+}
+
+
+// Runs the replay-daemon binary when the tools are built with the tests
+TEST(daemon_protocol) {
+#ifdef REPLAY_DAEMON_PATH
+  const std::string socket_path = scratch("daemon_protocol.sock");
+  pid_t daemon = ::fork();
+  if (daemon == 0) {
+    std::freopen("/dev/null", "w", stdout);
+    ::execl(REPLAY_DAEMON_PATH, REPLAY_DAEMON_PATH, socket_path.c_str(),
+            static_cast<char *>(nullptr));
+    ::_exit(127);
+  }
+  ASSERT_TRUE(daemon > 0);
+  struct Stop {
+    pid_t pid;
+    std::string path;
+    ~Stop() {
+      ::kill(pid, SIGTERM);
+      ::waitpid(pid, nullptr, 0);
+      std::remove(path.c_str());
+    }
+  } stop{daemon, socket_path};
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  bool connected = false;
+  for (int i = 0; i < 500 && !connected; ++i) {
+    connected = ::connect(fd, reinterpret_cast<sockaddr *>(&addr),
+                          sizeof(addr)) == 0;
+    if (!connected) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  ASSERT_TRUE(connected);
+
+  // Text lines and binary batches are read from the same buffer
+  std::string input;
+  auto receive = [fd, &input]() {
+    char buffer[4096];
+    ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) {
+      throw std::runtime_error("daemon closed the connection");
+    }
+    input.append(buffer, static_cast<size_t>(n));
+  };
+  auto take = [&input, &receive](size_t bytes) {
+    while (input.size() < bytes) {
+      receive();
+    }
+    std::string data = input.substr(0, bytes);
+    input.erase(0, bytes);
+    return data;
+  };
+  auto line = [&input, &receive, &take]() {
+    while (input.find('\n') == std::string::npos) {
+      receive();
+    }
+    std::string text = take(input.find('\n') + 1);
+    text.pop_back();
+    return text;
+  };
+  auto request = [fd, &line](const std::string &command) {
+    std::string text = command + "\n";
+    ::send(fd, text.data(), text.size(), 0);
+    return line();
+  };
+  auto u32 = [&take]() {
+    uint32_t value;
+    std::memcpy(&value, take(sizeof(value)).data(), sizeof(value));
+    return value;
+  };
+
+  ASSERT_EQ("ERR no file open", request("seek 1"));
+  Replay reference("example.csv");
+  const auto &keypaths = reference.source()->plan().keypaths;
+  ASSERT_EQ("OK " + std::to_string(reference.source()->row_count()) + " " +
+                std::to_string(keypaths.size()),
+            request("open example.csv"));
+  for (const auto &keypath : keypaths) {
+    ASSERT_EQ(keypath, line());
+  }
+
+  // Malformed arguments are rejected instead of read as 0
+  ASSERT_EQ("ERR invalid row abc", request("seek abc"));
+  ASSERT_EQ("ERR invalid row -1", request("seek -1"));
+  ASSERT_EQ("ERR missing row", request("seek"));
+  ASSERT_EQ("ERR invalid speed x", request("play x"));
+  ASSERT_EQ("ERR unknown column nope", request("select nope"));
+
+  ASSERT_EQ("OK 2", request("seek 2"));
+  ASSERT_EQ("OK 2", request("select speed driver.name"));
+  ASSERT_EQ("OK", request("play 0 2"));
+  ASSERT_EQ(0x424C5052u, u32());
+  ASSERT_EQ(2u, u32());
+  ASSERT_EQ(2u, u32());
+  reference.advance();
+  reference.advance();
+  for (int r = 0; r < 2; ++r) {
+    nlohmann::json row = reference.advance();
+    ASSERT_EQ(1, take(1)[0]);
+    double speed;
+    std::memcpy(&speed, take(sizeof(speed)).data(), sizeof(speed));
+    ASSERT_EQ(row["speed"].get<double>(), speed);
+    ASSERT_EQ(2, take(1)[0]);
+    ASSERT_EQ(row["driver"]["name"].get<std::string>(), take(u32()));
+  }
+  ASSERT_EQ(0x424C5052u, u32()); // end of play
+  ASSERT_EQ(0u, u32());
+  ASSERT_EQ(2u, u32());
+  ASSERT_EQ("OK 4", request("seek_time 1609459204"));
+  ::close(fd);
+#endif
+}
+
 // Helper function to run a specific test
 bool run_specific_test(const std::string& test_name) {
     if (test_name == "basic_csv_parsing") {
@@ -406,6 +1943,76 @@ bool run_specific_test(const std::string& test_name) {
         RUN_TEST(loop_functionality_enabled);
     } else if (test_name == "loop_toggle") {
         RUN_TEST(loop_toggle);
+    } else if (test_name == "shared_source_cursors") {
+        RUN_TEST(shared_source_cursors);
+    } else if (test_name == "cursor_seek") {
+        RUN_TEST(cursor_seek);
+    } else if (test_name == "concurrent_cursors") {
+        RUN_TEST(concurrent_cursors);
+    } else if (test_name == "dialect_sniffing") {
+        RUN_TEST(dialect_sniffing);
+    } else if (test_name == "dialect_parsing") {
+        RUN_TEST(dialect_parsing);
+    } else if (test_name == "custom_dialect_tokenizer") {
+        RUN_TEST(custom_dialect_tokenizer);
+    } else if (test_name == "arrow_export") {
+        RUN_TEST(arrow_export);
+    } else if (test_name == "seek_time") {
+        RUN_TEST(seek_time);
+    } else if (test_name == "paced_play") {
+        RUN_TEST(paced_play);
+    } else if (test_name == "parallel_ordered") {
+        RUN_TEST(parallel_ordered);
+    } else if (test_name == "cache_round_trip") {
+        RUN_TEST(cache_round_trip);
+    } else if (test_name == "prefetch_mode") {
+        RUN_TEST(prefetch_mode);
+    } else if (test_name == "memory_budget") {
+        RUN_TEST(memory_budget);
+    } else if (test_name == "error_policy_flag") {
+        RUN_TEST(error_policy_flag);
+    } else if (test_name == "error_policy_skip_and_quarantine") {
+        RUN_TEST(error_policy_skip_and_quarantine);
+    } else if (test_name == "bad_keypaths") {
+        RUN_TEST(bad_keypaths);
+    } else if (test_name == "plan_cache") {
+        RUN_TEST(plan_cache);
+    } else if (test_name == "lazy_row") {
+        RUN_TEST(lazy_row);
+    } else if (test_name == "trace_export") {
+        RUN_TEST(trace_export);
+    } else if (test_name == "metrics_export") {
+        RUN_TEST(metrics_export);
+    } else if (test_name == "huge_pages") {
+        RUN_TEST(huge_pages);
+    } else if (test_name == "numa_placement") {
+        RUN_TEST(numa_placement);
+    } else if (test_name == "realtime_play") {
+        RUN_TEST(realtime_play);
+    } else if (test_name == "reorder_buffer") {
+        RUN_TEST(reorder_buffer);
+    } else if (test_name == "external_sort") {
+        RUN_TEST(external_sort);
+    } else if (test_name == "hash_join") {
+        RUN_TEST(hash_join);
+    } else if (test_name == "derived_columns") {
+        RUN_TEST(derived_columns);
+    } else if (test_name == "schema_segments") {
+        RUN_TEST(schema_segments);
+    } else if (test_name == "block_checksums") {
+        RUN_TEST(block_checksums);
+    } else if (test_name == "shuffle_sample") {
+        RUN_TEST(shuffle_sample);
+    } else if (test_name == "shard_workers") {
+        RUN_TEST(shard_workers);
+    } else if (test_name == "extract_range") {
+        RUN_TEST(extract_range);
+    } else if (test_name == "recorder_round_trip") {
+        RUN_TEST(recorder_round_trip);
+    } else if (test_name == "parallel_segments") {
+        RUN_TEST(parallel_segments);
+    } else if (test_name == "daemon_protocol") {
+        RUN_TEST(daemon_protocol);
     } else {
         std::cout << "Unknown test: " << test_name << std::endl;
         return false;
@@ -434,6 +2041,41 @@ void run_all_tests() {
     RUN_TEST(loop_functionality_disabled);
     RUN_TEST(loop_functionality_enabled);
     RUN_TEST(loop_toggle);
+    RUN_TEST(shared_source_cursors);
+    RUN_TEST(cursor_seek);
+    RUN_TEST(concurrent_cursors);
+    RUN_TEST(dialect_sniffing);
+    RUN_TEST(dialect_parsing);
+    RUN_TEST(custom_dialect_tokenizer);
+    RUN_TEST(arrow_export);
+    RUN_TEST(seek_time);
+    RUN_TEST(paced_play);
+    RUN_TEST(parallel_ordered);
+    RUN_TEST(cache_round_trip);
+    RUN_TEST(prefetch_mode);
+    RUN_TEST(memory_budget);
+    RUN_TEST(error_policy_flag);
+    RUN_TEST(error_policy_skip_and_quarantine);
+    RUN_TEST(bad_keypaths);
+    RUN_TEST(plan_cache);
+    RUN_TEST(lazy_row);
+    RUN_TEST(trace_export);
+    RUN_TEST(metrics_export);
+    RUN_TEST(huge_pages);
+    RUN_TEST(numa_placement);
+    RUN_TEST(realtime_play);
+    RUN_TEST(reorder_buffer);
+    RUN_TEST(external_sort);
+    RUN_TEST(hash_join);
+    RUN_TEST(derived_columns);
+    RUN_TEST(schema_segments);
+    RUN_TEST(block_checksums);
+    RUN_TEST(shuffle_sample);
+    RUN_TEST(shard_workers);
+    RUN_TEST(extract_range);
+    RUN_TEST(recorder_round_trip);
+    RUN_TEST(parallel_segments);
+    RUN_TEST(daemon_protocol);
 
   // Print results
   std::cout << "\n================================\n";
@@ -0,0 +1,288 @@
+/*
+Benchmark of Replay's read paths. Every mode reads the whole file once per
+repetition; the fastest repetition is reported with its throughput and, on
+Linux, the hardware counters read through perf_event_open around it
+(cycles, instructions, branch misses, L1D and LLC read misses), per row and
+per byte. Counters that cannot be opened (no PMU, perf_event_paranoid,
+containers) are reported as n/a.
+
+Usage:
+  replay-bench [-r repeats] [-m mode] input.csv
+
+Modes (default: all):
+  tokenize   split every line into fields
+  advance    build a JSON object per row (ReplayCursor::advance)
+  lazy       lazy rows, reading one column per row
+*/
+
+#include "replay.hpp"
+#include "replay_tools.hpp"
+
+#include <array>
+#include <cstdint>
+#include <iomanip>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+void usage() {
+  std::cerr << "Usage: replay-bench [-r repeats] [-m tokenize|advance|lazy] "
+               "input.csv\n";
+}
+
+struct Event {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+#ifdef __linux__
+constexpr uint64_t cache_read_miss(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+const Event events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1D-misses", PERF_TYPE_HW_CACHE,
+     cache_read_miss(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC-misses", PERF_TYPE_HW_CACHE,
+     cache_read_miss(PERF_COUNT_HW_CACHE_LL)},
+};
+#else
+const Event events[] = {{"cycles", 0, 0}};
+#endif
+
+constexpr size_t event_count = sizeof(events) / sizeof(events[0]);
+
+// Hardware counters of the calling thread. Each counter is opened on its
+// own, so a missing one does not disable the others; values are scaled
+// when the kernel multiplexes them.
+class Counters {
+public:
+  Counters() {
+    _fds.fill(-1);
+#ifdef __linux__
+    for (size_t i = 0; i < event_count; ++i) {
+      perf_event_attr attr{};
+      attr.size = sizeof(attr);
+      attr.type = events[i].type;
+      attr.config = events[i].config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      _fds[i] = static_cast<int>(
+          ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+  }
+
+  ~Counters() {
+    for (int fd : _fds) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+
+  Counters(const Counters &) = delete;
+  Counters &operator=(const Counters &) = delete;
+
+  bool available(size_t i) const { return _fds[i] >= 0; }
+
+  bool any_available() const {
+    for (size_t i = 0; i < event_count; ++i) {
+      if (available(i)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void start() {
+#ifdef __linux__
+    for (int fd : _fds) {
+      if (fd >= 0) {
+        ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+#endif
+  }
+
+  // Stop counting and return the values; unavailable counters read -1
+  std::array<double, event_count> stop() {
+    std::array<double, event_count> values;
+    values.fill(-1);
+#ifdef __linux__
+    for (size_t i = 0; i < event_count; ++i) {
+      if (_fds[i] < 0) {
+        continue;
+      }
+      ::ioctl(_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      uint64_t data[3] = {0, 0, 0}; // value, time enabled, time running
+      if (::read(_fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+        values[i] = static_cast<double>(data[0]) * data[1] / data[2];
+      }
+    }
+#endif
+    return values;
+  }
+
+private:
+  std::array<int, event_count> _fds;
+};
+
+struct Result {
+  double seconds = 0;
+  size_t rows = 0;
+  std::array<double, event_count> counters;
+};
+
+// Read the whole source once in the given mode; returns the rows read
+size_t run_mode(const std::string &mode,
+                const std::shared_ptr<const ReplaySource> &source) {
+  ReplayCursor cursor(source);
+  size_t rows = 0;
+  if (mode == "tokenize") {
+    std::vector<std::string> fields;
+    std::string_view line;
+    while (cursor.next_line(line)) {
+      source->with_tokenizer([&line, &fields](auto tokenizer) {
+        tokenizer.split_line(line, fields);
+      });
+      ++rows;
+    }
+  } else if (mode == "advance") {
+    nlohmann::json row;
+    while (cursor.next_row(row)) {
+      ++rows;
+    }
+  } else if (mode == "lazy") {
+    const std::string &keypath = source->plan().keypaths.front();
+    ReplayLazyRow row;
+    double sum = 0;
+    while (cursor.next_lazy(row)) {
+      const nlohmann::json &value = row[keypath];
+      sum += value.is_number() ? value.get<double>() : 0.0;
+      ++rows;
+    }
+    volatile double sink = sum; // keep the conversions
+    (void)sink;
+  } else {
+    throw std::invalid_argument("Unknown mode: " + mode);
+  }
+  return rows;
+}
+
+void print_value(double value, double divisor) {
+  if (value < 0) {
+    std::cout << std::setw(12) << "n/a";
+  } else {
+    std::cout << std::setw(12) << std::setprecision(4) << value / divisor;
+  }
+}
+
+void report(const std::string &mode, const Result &r, size_t bytes,
+            const Counters &counters) {
+  const double seconds = std::max(r.seconds, 1e-9);
+  std::cout << std::fixed << std::setprecision(1) << mode << ": " << r.rows
+            << " rows in " << std::setprecision(4) << seconds << " s ("
+            << std::setprecision(1) << bytes / seconds / 1e6 << " MB/s, "
+            << r.rows / seconds << " rows/s)\n";
+  std::cout.unsetf(std::ios::floatfield);
+  if (!counters.any_available()) {
+    return;
+  }
+  std::cout << "  " << std::left << std::setw(14) << "counter" << std::right
+            << std::setw(12) << "total" << std::setw(12) << "per row"
+            << std::setw(12) << "per byte" << "\n";
+  for (size_t i = 0; i < event_count; ++i) {
+    std::cout << "  " << std::left << std::setw(14) << events[i].name
+              << std::right;
+    print_value(r.counters[i], 1);
+    print_value(r.counters[i], std::max<size_t>(r.rows, 1));
+    print_value(r.counters[i], std::max<size_t>(bytes, 1));
+    std::cout << "\n";
+  }
+  const double cycles = r.counters[0];
+  const double instructions = event_count > 1 ? r.counters[1] : -1;
+  if (cycles > 0 && instructions >= 0) {
+    std::cout << "  IPC " << std::setprecision(3) << instructions / cycles
+              << "\n";
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t repeats = 3;
+  std::vector<std::string> modes;
+  std::string path;
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "-r" && i + 1 < argc) {
+        repeats = std::max<size_t>(1, replay_option_number(arg, argv[++i]));
+      } else if (arg == "-m" && i + 1 < argc) {
+        modes.push_back(argv[++i]);
+      } else if (arg == "-h" || arg == "--help") {
+        usage();
+        return 0;
+      } else if (path.empty()) {
+        path = arg;
+      } else {
+        usage();
+        return 1;
+      }
+    }
+    if (path.empty()) {
+      usage();
+      return 1;
+    }
+    if (modes.empty()) {
+      modes = {"tokenize", "advance", "lazy"};
+    }
+
+    auto source = ReplaySource::open(path);
+    const size_t bytes = source->size() - source->data_begin();
+    Counters counters;
+    if (!counters.any_available()) {
+      std::cerr << "Hardware counters unavailable; reporting time only\n";
+    }
+
+    for (const auto &mode : modes) {
+      run_mode(mode, source); // warm up the page cache and the plan
+      Result best;
+      best.seconds = std::numeric_limits<double>::infinity();
+      for (size_t r = 0; r < repeats; ++r) {
+        Result result;
+        auto start = std::chrono::steady_clock::now();
+        counters.start();
+        result.rows = run_mode(mode, source);
+        result.counters = counters.stop();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        result.seconds = elapsed.count();
+        if (result.seconds < best.seconds) {
+          best = result;
+        }
+      }
+      report(mode, best, bytes, counters);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,159 @@
+/*
+Convert a CSV log into NDJSON, MessagePack or the Replay binary cache.
+Reading, parsing and writing are pipelined: chunks of the mapped file are
+prefetched, parsed by a pool of worker threads and written in file order.
+
+Usage:
+  replay-convert [-f ndjson|msgpack|cache] [-j threads] [-m MB] [-p] [-n node]
+                 input.csv output
+
+-m bounds the input chunks held in flight to the given number of megabytes.
+-p pins the worker threads to cores, spread over the NUMA nodes; -n runs
+them on the given NUMA node only.
+
+MessagePack output is a stream of one map per row.
+*/
+
+#include "replay.hpp"
+#include "replay_cache.hpp"
+#include "replay_parallel.hpp"
+#include "replay_tools.hpp"
+
+#include <cstdio>
+
+namespace {
+
+enum class Format { ndjson, msgpack, cache };
+
+void usage() {
+  std::cerr << "Usage: replay-convert [-f ndjson|msgpack|cache] [-j threads] "
+               "[-m MB] [-p] [-n node] input.csv output\n";
+}
+
+struct Chunk {
+  std::string bytes;
+  size_t rows = 0;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  Format format = Format::ndjson;
+  ReplayParallelOptions options;
+  ReplayMemoryBudget budget;
+  std::vector<std::string> paths;
+
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "-f" && i + 1 < argc) {
+        std::string f = argv[++i];
+        if (f == "ndjson") {
+          format = Format::ndjson;
+        } else if (f == "msgpack") {
+          format = Format::msgpack;
+        } else if (f == "cache") {
+          format = Format::cache;
+        } else {
+          usage();
+          return 1;
+        }
+      } else if (arg == "-j" && i + 1 < argc) {
+        options.threads = replay_option_number(arg, argv[++i]);
+      } else if (arg == "-m" && i + 1 < argc) {
+        budget.set_limit(replay_option_number(arg, argv[++i]) << 20);
+        options.budget = &budget;
+      } else if (arg == "-p") {
+        options.pin_threads = true;
+      } else if (arg == "-n" && i + 1 < argc) {
+        options.numa_node =
+            static_cast<int>(replay_option_number(arg, argv[++i]));
+      } else if (arg == "-h" || arg == "--help") {
+        usage();
+        return 0;
+      } else {
+        paths.push_back(arg);
+      }
+    }
+    if (paths.size() != 2) {
+      usage();
+      return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto source = ReplaySource::open(paths[0]);
+    // The cache holds a single header
+    if (format == Format::cache && source->segments().size() > 1) {
+      throw std::runtime_error(
+          "The cache format cannot hold a file with header changes");
+    }
+
+    std::FILE *out = std::fopen(paths[1].c_str(), "wb");
+    if (!out) {
+      throw std::runtime_error("Failed to open output file: " + paths[1]);
+    }
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> out_guard(out,
+                                                               &std::fclose);
+    auto write = [out](const std::string &bytes) {
+      if (std::fwrite(bytes.data(), 1, bytes.size(), out) != bytes.size()) {
+        throw std::runtime_error("Write error");
+      }
+    };
+    if (format == Format::cache) {
+      write(ReplayCache::encode_header(source->plan()));
+    }
+
+    size_t rows = 0;
+    size_t out_bytes = 0;
+    ReplayParallel::run<Chunk>(
+        *source,
+        [&source, format](std::string_view chunk, Chunk &result) {
+          std::vector<std::string> fields;
+          std::vector<uint8_t> packed;
+          ReplayParallel::for_each_row(
+              *source, chunk,
+              [&](std::string_view line, const ReplayPlan &plan) {
+                source->with_tokenizer([&line, &fields](auto tokenizer) {
+                  tokenizer.split_line(line, fields);
+                });
+                ++result.rows;
+                if (format == Format::cache) {
+                  ReplayCache::encode_row(fields, result.bytes);
+                  return;
+                }
+                nlohmann::json row = plan.build(fields);
+                if (format == Format::ndjson) {
+                  result.bytes += row.dump();
+                  result.bytes += '\n';
+                } else {
+                  packed.clear();
+                  nlohmann::json::to_msgpack(row, packed);
+                  result.bytes.append(packed.begin(), packed.end());
+                }
+              });
+        },
+        [&](Chunk &chunk) {
+          write(chunk.bytes);
+          rows += chunk.rows;
+          out_bytes += chunk.bytes.size();
+        },
+        options);
+    // Buffered writes can still fail here (e.g. on a full disk)
+    if (std::fflush(out) != 0 || std::fclose(out_guard.release()) != 0) {
+      throw std::runtime_error("Write error");
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    double seconds = std::max(elapsed.count(), 1e-9);
+    double in_mb = source->size() / 1e6;
+    std::cerr << "Converted " << rows << " rows, " << in_mb << " MB in -> "
+              << out_bytes / 1e6 << " MB out in " << seconds << " s ("
+              << in_mb / seconds << " MB/s, " << rows / seconds
+              << " rows/s)\n";
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
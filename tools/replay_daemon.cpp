@@ -0,0 +1,414 @@
+/*
+Local replay daemon: keeps Replay sources (mapped and indexed) resident and
+serves any number of clients over a Unix domain socket, so that the cost of
+opening and indexing large logs is paid once per host.
+
+Usage:
+  replay-daemon [socket_path]        (default: /tmp/replay.sock)
+
+Protocol: clients send text commands, one per line; every command is answered
+with "OK ..." or "ERR <message>" on a single line.
+  open <path>             OK <rows> <columns>, then one keypath per line
+  select <kp> [<kp>...]   OK <columns>; "select *" selects all columns
+  time <kp>               OK <column>; time column for seek_time and play
+  seek <row>              OK <row>
+  seek_time <t>           OK <row>
+  play <speed> [<rows>]   OK, then binary batches (speed 0 = no pacing)
+  quit                    closes the connection
+
+Binary batches (host byte order):
+  uint32 magic 'RPLB', uint32 rows, uint32 columns, then for every cell
+  uint8 tag: 0 = missing, 1 = float64 (8 bytes), 2 = string (uint32 length +
+  bytes). A batch with 0 rows ends the play command.
+Selected columns are matched by keypath in every schema segment (see the
+README); cells of columns missing from a row's segment are sent as missing.
+*/
+
+#include "replay.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <future>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace {
+
+constexpr uint32_t batch_magic = 0x424C5052; // "RPLB"
+constexpr size_t batch_rows = 1024;
+
+// Sources stay resident for the lifetime of the daemon and are shared by all
+// sessions opening the same file. The first session to open a path maps and
+// indexes it outside the lock; later sessions wait for that path only.
+class SourceCache {
+public:
+  std::shared_ptr<const ReplaySource> open(const std::string &path) {
+    char resolved[PATH_MAX];
+    std::string key = ::realpath(path.c_str(), resolved) ? resolved : path;
+    std::promise<std::shared_ptr<const ReplaySource>> opened;
+    std::shared_future<std::shared_ptr<const ReplaySource>> source;
+    bool opener = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _sources.find(key);
+      if (it == _sources.end()) {
+        it = _sources.emplace(key, opened.get_future().share()).first;
+        opener = true;
+      }
+      source = it->second;
+    }
+    if (opener) {
+      try {
+        auto s = ReplaySource::open(key);
+        s->row_index(); // index once, before any client needs it
+        opened.set_value(s);
+      } catch (...) {
+        opened.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(_mutex);
+        _sources.erase(key); // let a later open retry
+      }
+    }
+    return source.get();
+  }
+
+private:
+  std::mutex _mutex;
+  std::map<std::string,
+           std::shared_future<std::shared_ptr<const ReplaySource>>>
+      _sources;
+};
+
+class Session {
+public:
+  Session(int fd, SourceCache &cache) : _fd(fd), _cache(cache) {}
+
+  ~Session() { ::close(_fd); }
+
+  void run() {
+    std::string line;
+    while (read_line(line)) {
+      std::istringstream in(line);
+      std::string command;
+      in >> command;
+      if (command.empty()) {
+        continue;
+      }
+      if (command == "quit") {
+        return;
+      }
+      try {
+        if (!dispatch(command, in)) {
+          return;
+        }
+      } catch (const std::exception &e) {
+        if (!send_text("ERR " + std::string(e.what()) + "\n")) {
+          return;
+        }
+      }
+    }
+  }
+
+private:
+  int _fd;
+  SourceCache &_cache;
+  std::string _input;
+  std::unique_ptr<ReplayCursor> _cursor;
+  // Selected and time keypaths, and their columns in the plan of the rows
+  // being sent (resolved again at every schema segment change)
+  std::vector<std::string> _keypaths;
+  std::string _time_keypath;
+  size_t _time_column = 0; // in the first header, for seek_time
+  const ReplayPlan *_columns_plan = nullptr;
+  std::vector<size_t> _columns;
+  size_t _time_field = 0;
+  std::vector<std::string> _fields;
+  std::string _batch;
+
+  // Returns false when the client has gone away
+  bool dispatch(const std::string &command, std::istringstream &in) {
+    if (command == "open") {
+      std::string path;
+      std::getline(in >> std::ws, path);
+      auto source = _cache.open(path);
+      _cursor = std::make_unique<ReplayCursor>(source);
+      _keypaths = source->plan().keypaths;
+      _time_keypath = _keypaths.front();
+      _time_column = 0;
+      _columns_plan = nullptr;
+      std::string reply = "OK " + std::to_string(source->row_count()) + " " +
+                          std::to_string(_keypaths.size()) + "\n";
+      for (const auto &kp : source->plan().keypaths) {
+        reply += kp + "\n";
+      }
+      return send_text(reply);
+    }
+
+    const ReplayPlan &plan = cursor().source().plan();
+    if (command == "select") {
+      std::vector<std::string> keypaths;
+      std::string keypath;
+      while (in >> keypath) {
+        if (keypath == "*") {
+          keypaths.insert(keypaths.end(), plan.keypaths.begin(),
+                          plan.keypaths.end());
+          continue;
+        }
+        // Columns of later schema segments can be selected too
+        const auto &segments = cursor().source().segments();
+        if (std::none_of(segments.begin(), segments.end(),
+                         [&keypath](const ReplaySegment &s) {
+                           return s.plan->column_index(keypath) !=
+                                  ReplayPlan::npos;
+                         })) {
+          throw std::runtime_error("unknown column " + keypath);
+        }
+        keypaths.push_back(keypath);
+      }
+      _keypaths = keypaths;
+      _columns_plan = nullptr;
+      return send_text("OK " + std::to_string(_keypaths.size()) + "\n");
+    }
+    if (command == "time") {
+      std::string keypath;
+      in >> keypath;
+      _time_column = column(plan, keypath);
+      _time_keypath = keypath;
+      _columns_plan = nullptr;
+      return send_text("OK " + std::to_string(_time_column) + "\n");
+    }
+    if (command == "seek") {
+      size_t row = argument<size_t>(in, "row");
+      cursor().seek(row);
+      return send_text("OK " + std::to_string(cursor().tell()) + "\n");
+    }
+    if (command == "seek_time") {
+      double t = argument<double>(in, "time");
+      cursor().seek_time(t, _time_column);
+      return send_text("OK " + std::to_string(cursor().tell()) + "\n");
+    }
+    if (command == "play") {
+      double speed = argument<double>(in, "speed");
+      size_t max_rows =
+          (in >> std::ws).eof() ? 0 : argument<size_t>(in, "row count");
+      return send_text("OK\n") && play(speed, max_rows);
+    }
+    throw std::runtime_error("unknown command " + command);
+  }
+
+  ReplayCursor &cursor() {
+    if (!_cursor) {
+      throw std::runtime_error("no file open");
+    }
+    return *_cursor;
+  }
+
+  // Next argument of a command; missing or malformed values are errors
+  template <typename T>
+  static T argument(std::istringstream &in, const char *name) {
+    std::string text;
+    if (!(in >> text)) {
+      throw std::runtime_error(std::string("missing ") + name);
+    }
+    std::istringstream field(text);
+    T value{};
+    if ((std::is_unsigned<T>::value && text[0] == '-') || !(field >> value) ||
+        !(field >> std::ws).eof()) {
+      throw std::runtime_error(std::string("invalid ") + name + " " + text);
+    }
+    return value;
+  }
+
+  static size_t column(const ReplayPlan &plan, const std::string &keypath) {
+    size_t c = plan.column_index(keypath);
+    if (c == ReplayPlan::npos) {
+      throw std::runtime_error("unknown column " + keypath);
+    }
+    return c;
+  }
+
+  // Stream rows in binary batches. With speed > 0 each row is held back
+  // until due, and rows that are already due are sent together.
+  bool play(double speed, size_t max_rows) {
+    using clock = std::chrono::steady_clock;
+    ReplayCursor &cur = cursor();
+    bool started = false;
+    double t0 = 0;
+    clock::time_point wall0;
+    uint32_t rows = 0;
+    size_t sent = 0;
+    std::string_view line;
+
+    begin_batch();
+    while ((max_rows == 0 || sent < max_rows) && cur.next_line(line)) {
+      cur.source().with_tokenizer(
+          [this, line](auto tokenizer) { tokenizer.split_line(line, _fields); });
+      if (&cur.plan() != _columns_plan) {
+        resolve(cur.plan());
+      }
+
+      if (speed > 0 && _time_field < _fields.size() &&
+          ReplayCsv::is_numeric(_fields[_time_field])) {
+        double t = ReplayCsv::parse_number(_fields[_time_field]);
+        auto now = clock::now();
+        if (!started || t < t0) {
+          started = true;
+          t0 = t;
+          wall0 = now;
+        }
+        auto due = wall0 + std::chrono::duration_cast<clock::duration>(
+                               std::chrono::duration<double>((t - t0) / speed));
+        if (due > now) {
+          if (rows > 0 && !end_batch(rows)) {
+            return false;
+          }
+          rows = 0;
+          begin_batch();
+          std::this_thread::sleep_until(due);
+        }
+      }
+
+      append_row();
+      ++sent;
+      if (++rows == batch_rows) {
+        if (!end_batch(rows)) {
+          return false;
+        }
+        rows = 0;
+        begin_batch();
+      }
+    }
+    if (rows > 0) {
+      if (!end_batch(rows)) {
+        return false;
+      }
+      begin_batch();
+    }
+    return end_batch(0);
+  }
+
+  // Columns of the selected keypaths in plan (npos where missing)
+  void resolve(const ReplayPlan &plan) {
+    _columns.clear();
+    for (const auto &keypath : _keypaths) {
+      _columns.push_back(plan.column_index(keypath));
+    }
+    _time_field = plan.column_index(_time_keypath);
+    _columns_plan = &plan;
+  }
+
+  template <typename T> void put(const T &value) {
+    _batch.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  void begin_batch() {
+    _batch.clear();
+    put(batch_magic);
+    put(uint32_t(0));
+    put(static_cast<uint32_t>(_keypaths.size()));
+  }
+
+  void append_row() {
+    for (size_t c : _columns) {
+      if (c >= _fields.size()) {
+        put(uint8_t(0));
+      } else if (ReplayCsv::is_numeric(_fields[c])) {
+        put(uint8_t(1));
+        put(ReplayCsv::parse_number(_fields[c]));
+      } else {
+        put(uint8_t(2));
+        put(static_cast<uint32_t>(_fields[c].size()));
+        _batch.append(_fields[c]);
+      }
+    }
+  }
+
+  bool end_batch(uint32_t rows) {
+    std::memcpy(&_batch[sizeof(uint32_t)], &rows, sizeof(rows));
+    return send_all(_batch.data(), _batch.size());
+  }
+
+  bool send_text(const std::string &text) {
+    return send_all(text.data(), text.size());
+  }
+
+  bool send_all(const char *data, size_t size) {
+    while (size > 0) {
+      // SIGPIPE is ignored in main(), so no MSG_NOSIGNAL (not on macOS)
+      ssize_t n = ::send(_fd, data, size, 0);
+      if (n <= 0) {
+        return false;
+      }
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  bool read_line(std::string &line) {
+    for (;;) {
+      size_t nl = _input.find('\n');
+      if (nl != std::string::npos) {
+        line = _input.substr(0, nl);
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        _input.erase(0, nl + 1);
+        return true;
+      }
+      char buffer[4096];
+      ssize_t n = ::recv(_fd, buffer, sizeof(buffer), 0);
+      if (n <= 0) {
+        return false;
+      }
+      _input.append(buffer, static_cast<size_t>(n));
+    }
+  }
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::string socket_path = argc > 1 ? argv[1] : "/tmp/replay.sock";
+  std::signal(SIGPIPE, SIG_IGN);
+
+  int server = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    std::perror("socket");
+    return 1;
+  }
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "Error: socket path too long: " << socket_path << std::endl;
+    return 1;
+  }
+  std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+  ::unlink(socket_path.c_str());
+  if (::bind(server, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      ::listen(server, 64) != 0) {
+    std::perror("bind/listen");
+    return 1;
+  }
+  std::cout << "replay-daemon listening on " << socket_path << std::endl;
+
+  SourceCache cache;
+  for (;;) {
+    int client = ::accept(server, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::perror("accept");
+      break;
+    }
+    std::thread([client, &cache]() {
+      Session session(client, cache);
+      session.run();
+    }).detach();
+  }
+  ::close(server);
+  return 0;
+}
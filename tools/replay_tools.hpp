@@ -0,0 +1,28 @@
+/*
+Helpers shared by the command line tools.
+AUthor: Paolo Bosetti, University of Trento
+License: MIT
+*/
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// Value of a numeric command line option. Negative numbers and trailing
+// garbage are rejected with an exception naming the option, so that tools
+// report bad input instead of aborting.
+inline size_t replay_option_number(const std::string &option,
+                                   const std::string &value) {
+  try {
+    if (!value.empty() && value[0] != '-') {
+      size_t end = 0;
+      size_t n = std::stoul(value, &end);
+      if (end == value.size()) {
+        return n;
+      }
+    }
+  } catch (const std::logic_error &) {
+  }
+  throw std::invalid_argument("Invalid value for " + option + ": " + value);
+}